@@ -40,6 +40,11 @@ static driver_reset_ptr driver_reset;
 static user_mcode_ptrs_t user_mcode;
 static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
 static on_realtime_report_ptr on_realtime_report;
+static on_homing_completed_ptr on_homing_completed;
+static on_probe_start_ptr on_probe_start;
+static on_probe_completed_ptr on_probe_completed;
+static on_probe_fixture_ptr on_probe_fixture;
+static on_toolchange_ack_ptr on_toolchange_ack;
 
 static spindle_id_t spindle_id;
 static spindle_ptrs_t *spindle_hal = NULL;
@@ -60,38 +65,109 @@ static const modbus_callbacks_t callbacks = {
 static coolant_state_t current_coolant_state;
 static IPG_state_t current_IPG_state;
 static BLC_state_t current_BLC_state;
-static uint16_t current_BLC_flowrate = (10 | (10 << 8)); //Initialize both powder flow rates to 1.0RPM
+static uint16_t current_BLC_flowrate[2] = { 10 << 8, 10 << 8 }; //Initialize both powder flow rates to 1.0RPM (UQ8.8)
+static uint16_t current_output_bank[PICOHAL_OUTPUT_REGS] = {0};
+static uint32_t output_bank_dirty = 0;      // one bit per output bank register not yet queued
+static picohal_capabilities_t picohal_caps = {0};
+static uint16_t picohal_device_id = 0, picohal_fw_version = 0;
+static picohal_link_t picohal_link = PicoHAL_Offline;
+static uint32_t reset_ms, send_ms;
+static uint_fast8_t handshake_retries;
+static uint16_t heartbeat_seq = 0;
+
+//events are held until the frame carrying them is acknowledged.
+static uint16_t event_fifo[PICOHAL_EVENT_QUEUE_SIZE];
+static uint_fast8_t event_head = 0, event_count = 0, events_in_flight = 0;
+static uint8_t event_seq = 0;
+
+//analog inputs are only ever served from this cache, refreshed in the background.
+static uint16_t analog_in[PICOHAL_ANALOG_INPUTS];
+static uint_fast8_t analog_next = 0;
+static bool analog_read_pending = false, analog_valid = false, analog_registered = false;
+static uint32_t analog_ms;
+static const char *analog_descr[PICOHAL_ANALOG_INPUTS];
+
+//exceptions are aggregated here and summarized from the poll loop.
+static struct {
+    uint16_t total;
+    uint16_t code[PICOHAL_EXCEPTION_CODES];
+    struct {
+        uint16_t reg;
+        uint16_t count;
+    } reg[PICOHAL_EXCEPTION_REGS];
+} exceptions = {0};
 
 static sys_state_t current_state; 
 
+//coolant and state changes are coalesced over PICOHAL_DEBOUNCE_WINDOW, only the net change is sent.
+static bool coolant_pending = false, state_pending = false;
+static coolant_state_t coolant_before;
+static sys_state_t state_before;
+static uint32_t coolant_ms, state_ms;
+
 typedef struct {
     uint16_t index;
+    bool latest_only;   // state write that may be superseded by a later write to the same register(s)
     modbus_message_t picohal_packet;
 } QueueItem;
 
-QueueItem message_queue[QUEUE_SIZE];
-int front = 0;
-int rear = -1;
-int item_count = 0;
-modbus_message_t current_message;
-modbus_message_t * current_msg_ptr = &current_message;
-uint16_t current_index;
+static QueueItem message_queue[QUEUE_SIZE];
+static uint_fast8_t front = 0;
+static uint_fast8_t item_count = 0;
+static modbus_message_t current_message;
+static modbus_message_t * current_msg_ptr = &current_message;
 
 static bool enqueue_message(modbus_message_t data) {
     static uint16_t message_index;
+    uint_fast8_t rear;
     if (item_count == QUEUE_SIZE) {
         report_message("Warning: PicoHAL queue is full.", Message_Warning);
         return 0;
     }
-    rear = (rear + 1) % QUEUE_SIZE;
+    rear = (front + item_count) % QUEUE_SIZE;
     message_queue[rear].picohal_packet = data;
     message_queue[rear].index = message_index;
+    message_queue[rear].latest_only = false;
     message_queue[rear].picohal_packet.context = &message_queue[rear].index;
     message_index++;
     item_count++;
         return 1;
 }
 
+static inline bool picohal_same_target (const modbus_message_t *a, const modbus_message_t *b)
+{
+    return a->adu[1] == b->adu[1] && a->adu[2] == b->adu[2] && a->adu[3] == b->adu[3] &&
+            (a->adu[1] != ModBus_WriteRegisters || a->adu[5] == b->adu[5]);
+}
+
+// Queue a state write, only the latest value matters so a pending write to the same
+// register(s) is updated in place. This keeps a full queue from losing the latest state.
+static bool enqueue_state_message(modbus_message_t data) {
+
+    //only the last pending item can be merged into, any write queued after it must still reach the
+    //board after it. Front may already be in flight, leave it alone.
+    if(item_count > 1) {
+        uint_fast8_t pos = (front + item_count - 1) % QUEUE_SIZE;
+        if(message_queue[pos].latest_only && picohal_same_target(&message_queue[pos].picohal_packet, &data)) {
+            data.context = message_queue[pos].picohal_packet.context;
+            message_queue[pos].picohal_packet = data;
+            return 1;
+        }
+    }
+
+    if(!enqueue_message(data))
+        return 0;
+
+    message_queue[(front + item_count - 1) % QUEUE_SIZE].latest_only = true;
+    return 1;
+}
+
+// Responses and exceptions are only valid for the message at the front of the queue.
+static inline bool picohal_is_front (void *context)
+{
+    return item_count && context == &message_queue[front].index;
+}
+
 static bool dequeue_message() {
     if (item_count == 0) {
         //report_message("Error: queue is empty", Message_Info);
@@ -127,22 +203,370 @@ static void picohal_send (){
     }
 }
 
+static inline uint16_t picohal_get_register (const char *data)
+{
+    return ((uint8_t)data[0] << 8) | (uint8_t)data[1];
+}
+
+static modbus_message_t picohal_register_write (uint16_t reg, uint16_t value)
+{
+    modbus_message_t cmd = {
+        .context = NULL,
+        .crc_check = false,
+        .adu[0] = PICOHAL_ADDRESS,
+        .adu[1] = ModBus_WriteRegister,
+        .adu[2] = reg >> 8,
+        .adu[3] = reg & 0xFF,
+        .adu[4] = value >> 8,
+        .adu[5] = value & 0xFF,
+        .tx_length = 8,
+        .rx_length = 8
+    };
+
+    return cmd;
+}
+
+static bool picohal_write_registers (uint16_t reg, const uint16_t *values, uint_fast8_t count)
+{
+    uint_fast8_t idx;
+
+    if(count == 0 || count > PICOHAL_WRITE_REGS_MAX)
+        return false;
+
+    modbus_message_t cmd = {
+        .context = NULL,
+        .crc_check = false,
+        .adu[0] = PICOHAL_ADDRESS,
+        .adu[1] = ModBus_WriteRegisters,
+        .adu[2] = reg >> 8,
+        .adu[3] = reg & 0xFF,
+        .adu[4] = 0x00,
+        .adu[5] = count,
+        .adu[6] = count * 2,
+        .tx_length = 9 + count * 2,
+        .rx_length = 8
+    };
+
+    for(idx = 0; idx < count; idx++) {
+        cmd.adu[7 + idx * 2] = values[idx] >> 8;
+        cmd.adu[8 + idx * 2] = values[idx] & 0xFF;
+    }
+
+    return enqueue_state_message(cmd);
+}
+
+static bool picohal_read_registers (uint16_t reg, uint_fast8_t count)
+{
+    if(count == 0 || count > PICOHAL_READ_REGS_MAX)
+        return false;
+
+    modbus_message_t cmd = {
+        .context = NULL,
+        .crc_check = false,
+        .adu[0] = PICOHAL_ADDRESS,
+        .adu[1] = ModBus_ReadHoldingRegisters,
+        .adu[2] = reg >> 8,
+        .adu[3] = reg & 0xFF,
+        .adu[4] = 0x00,
+        .adu[5] = count,
+        .tx_length = 8,
+        .rx_length = 5 + count * 2
+    };
+
+    return enqueue_message(cmd);
+}
+
+static void picohal_sync_state (void);
+static void picohal_flush_output_bank (void);
+
+static void picohal_get_device_info (void)
+{
+    //read device ID, firmware version and capabilities from 0x0010 - 0x0012,
+    //in one transaction unless the ADU buffer is too small for it.
+    uint_fast8_t offset = 0, count;
+
+    picohal_link = PicoHAL_Handshake;
+    picohal_caps.value = 0;         // writes queued before the handshake completes use legacy encodings
+    picohal_device_id = picohal_fw_version = 0;
+    handshake_retries = 0;
+    analog_valid = false;           // don't serve values cached before the reset
+
+    while(offset < PICOHAL_INFO_BLOCK_SIZE) {
+        count = min(PICOHAL_INFO_BLOCK_SIZE - offset, PICOHAL_READ_REGS_MAX);
+        picohal_read_registers(PICOHAL_REG_DEVICE_ID + offset, count);
+        offset += count;
+    }
+}
+
+// A cache that has not been refreshed for PICOHAL_ANALOG_MAX_AGE is not served, the board may have stopped answering.
+static inline bool picohal_analog_fresh (void)
+{
+    return picohal_caps.analog_in && analog_valid && hal.get_elapsed_ticks() - analog_ms < PICOHAL_ANALOG_MAX_AGE;
+}
+
+// M66 on one of our analog ports returns the cached value, never waits on the bus.
+static int32_t waitOnInput (io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout)
+{
+    UNUSED(timeout);
+
+    if(type != Port_Analog || port >= PICOHAL_ANALOG_INPUTS || wait_mode != WaitMode_Immediate)
+        return -1;
+
+    return picohal_analog_fresh() ? (int32_t)analog_in[port] : -1;
+}
+
+static float getAnalogValue (xbar_t *pin)
+{
+    return picohal_analog_fresh() ? (float)analog_in[pin->pin] : -1.0f;
+}
+
+static xbar_t *getPinInfo (io_port_type_t type, io_port_direction_t dir, uint8_t port)
+{
+    static xbar_t pin;
+
+    if(type != Port_Analog || dir != Port_Input || port >= PICOHAL_ANALOG_INPUTS)
+        return NULL;
+
+    memset(&pin, 0, sizeof(xbar_t));
+    pin.function = Input_Analog_Aux0 + port;
+    pin.group = PinGroup_AuxInputAnalog;
+    pin.pin = port;
+    pin.description = analog_descr[port];
+    pin.get_value = getAnalogValue;
+
+    return &pin;
+}
+
+static void setPinDescription (io_port_type_t type, io_port_direction_t dir, uint8_t port, const char *description)
+{
+    if(type == Port_Analog && dir == Port_Input && port < PICOHAL_ANALOG_INPUTS)
+        analog_descr[port] = description;
+}
+
+static bool claimPort (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description)
+{
+    if(type != Port_Analog || dir != Port_Input || *port >= PICOHAL_ANALOG_INPUTS)
+        return false;
+
+    analog_descr[*port] = description;
+
+    return true;
+}
+
+static io_analog_t analog_ports = {
+    .n_in = PICOHAL_ANALOG_INPUTS,
+    .wait_on_input = waitOnInput,
+    .get_pin_info = getPinInfo,
+    .claim = claimPort,
+    .set_pin_description = setPinDescription
+};
+
+// Add board analog inputs to the aux analog ports once firmware reporting them has been seen.
+static void picohal_register_analog (void *data)
+{
+    UNUSED(data);
+
+    if(!analog_registered && (analog_registered = ioports_add_analog(&analog_ports)) == false)
+        report_message("PicoHAL: failed to add analog input ports", Message_Warning);
+}
+
+static void picohal_handshake_completed (void)
+{
+    uint_fast8_t idx;
+
+    //a reset meanwhile queued another handshake, leave the sync to that one.
+    for(idx = 0; idx < item_count; idx++) {
+        modbus_message_t *msg = &message_queue[(front + idx) % QUEUE_SIZE].picohal_packet;
+        if(msg->adu[1] == ModBus_ReadHoldingRegisters && picohal_get_register(&msg->adu[2]) + (uint8_t)msg->adu[5] > PICOHAL_REG_CAPABILITIES &&
+            picohal_get_register(&msg->adu[2]) <= PICOHAL_REG_CAPABILITIES)
+            return;
+    }
+
+    picohal_caps.unused = 0;
+
+    if(picohal_device_id != PICOHAL_DEVICE_ID || (picohal_fw_version >> 8) != PICOHAL_FW_VERSION_MAJOR) {
+        if(picohal_device_id || picohal_fw_version)
+            report_message("PicoHAL: unsupported device or firmware version, using legacy registers", Message_Warning);
+        picohal_caps.value = 0;
+    }
+
+    if(picohal_caps.analog_in && !analog_registered)
+        protocol_enqueue_foreground_task(picohal_register_analog, NULL);
+
+    picohal_sync_state();
+}
+
+static void picohal_rx_registers (modbus_message_t *msg)
+{
+    uint16_t reg = picohal_get_register(&current_message.adu[2]);
+    uint_fast8_t idx, count = (uint8_t)current_message.adu[5];
+
+    for(idx = 0; idx < count; idx++, reg++) {
+
+        uint16_t value = picohal_get_register(&msg->adu[3 + idx * 2]);
+
+        switch(reg) {
+
+            case PICOHAL_REG_DEVICE_ID:
+                picohal_device_id = value;
+                break;
+
+            case PICOHAL_REG_FW_VERSION:
+                picohal_fw_version = value;
+                break;
+
+            case PICOHAL_REG_CAPABILITIES:
+                picohal_caps.value = value;
+                picohal_handshake_completed();
+                break;
+
+            default:
+                if(reg >= PICOHAL_REG_ANALOG_IN && reg < PICOHAL_REG_ANALOG_IN + PICOHAL_ANALOG_INPUTS)
+                    analog_in[reg - PICOHAL_REG_ANALOG_IN] = value;
+                break;
+        }
+    }
+
+    reg = picohal_get_register(&current_message.adu[2]);
+    if(reg >= PICOHAL_REG_ANALOG_IN && reg < PICOHAL_REG_ANALOG_IN + PICOHAL_ANALOG_INPUTS && analog_read_pending) {
+        analog_read_pending = false;
+        if((analog_next = reg - PICOHAL_REG_ANALOG_IN + count) >= PICOHAL_ANALOG_INPUTS) {
+            analog_next = 0;                        // refresh cycle completed
+            analog_valid = true;
+            analog_ms = hal.get_elapsed_ticks();
+        }
+    }
+}
+
+static void picohal_read_analog (uint32_t ms)
+{
+    //bulk read analog inputs from 0x0300, one frame at a time so that writes queued
+    //meanwhile wait for at most one read. Split only when the ADU buffer is too small.
+    if(analog_read_pending || (analog_next == 0 && ms - analog_ms < PICOHAL_ANALOG_INTERVAL))
+        return;
+
+    if(picohal_read_registers(PICOHAL_REG_ANALOG_IN + analog_next, min(PICOHAL_ANALOG_INPUTS - analog_next, PICOHAL_READ_REGS_MAX)))
+        analog_read_pending = true;
+}
+
+static void picohal_create_event (picohal_events event)
+{
+    if(event_count == PICOHAL_EVENT_QUEUE_SIZE) {
+        report_message("Warning: PicoHAL event queue is full.", Message_Warning);
+        return;
+    }
+
+    event_fifo[(event_head + event_count) % PICOHAL_EVENT_QUEUE_SIZE] = (event_seq++ << 8) | event;
+    event_count++;
+}
+
+static void picohal_send_events (void)
+{
+    //only one event frame in flight, events raised meanwhile go out in the next batch.
+    if(events_in_flight || event_count == 0)
+        return;
+
+    uint16_t records[PICOHAL_EVENT_BATCH];
+    uint_fast8_t idx, count = picohal_caps.event_fifo ? min(event_count, PICOHAL_EVENT_BATCH) : 1;
+
+    //a batch needs an ADU of 9 + 2 * count bytes, the stock core buffer of 10 only has room for single
+    //register writes. Those go out back to back from picohal_send_next() while the bus is otherwise idle.
+    if(count > PICOHAL_WRITE_REGS_MAX)
+        count = max(PICOHAL_WRITE_REGS_MAX, 1);
+
+    for(idx = 0; idx < count; idx++)
+        records[idx] = event_fifo[(event_head + idx) % PICOHAL_EVENT_QUEUE_SIZE];
+
+    if(count > 1) {
+        //write batch of event records starting at register 0x0040
+        if(picohal_write_registers(PICOHAL_REG_EVENT_FIFO, records, count))
+            events_in_flight = count;
+        return;
+    }
+
+    //write single event record to register 0x0040, or the bare event to 0x0005 for legacy firmware
+    uint16_t reg = picohal_caps.event_fifo ? PICOHAL_REG_EVENT_FIFO : PICOHAL_REG_EVENT;
+    uint16_t data = picohal_caps.event_fifo ? records[0] : (records[0] & 0xFF);
+
+    modbus_message_t cmd = {
+        .context = NULL,
+        .crc_check = false,
+        .adu[0] = PICOHAL_ADDRESS,
+        .adu[1] = ModBus_WriteRegister,
+        .adu[2] = reg >> 8,
+        .adu[3] = reg & 0xFF,
+        .adu[4] = data >> 8,
+        .adu[5] = data & 0xFF,
+        .tx_length = 8,
+        .rx_length = 8
+    };
+
+    if(enqueue_message(cmd))
+        events_in_flight = 1;
+}
+
+static void picohal_events_acked (void)
+{
+    event_head = (event_head + events_in_flight) % PICOHAL_EVENT_QUEUE_SIZE;
+    event_count -= events_in_flight;
+    events_in_flight = 0;
+}
+
+static void picohal_check_ready (uint32_t ms)
+{
+    if(item_count == 0 && output_bank_dirty == 0 && picohal_link == PicoHAL_Syncing) {
+        char buf[40];
+
+        picohal_link = PicoHAL_Ready;
+        sprintf(buf, "PicoHAL ready in %lu ms", (unsigned long)(ms - reset_ms));
+        report_message(buf, Message_Info);
+    }
+}
+
+// While the link comes up, and while events are backed up on an otherwise idle bus, the next
+// frame goes out as soon as the previous one is answered, not at the polling rate.
+// Called from the response callbacks so the send does not block.
+static void picohal_send_next (void)
+{
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    if(picohal_link == PicoHAL_Ready) {
+        if(item_count || event_count == 0)
+            return;
+        picohal_send_events();
+    } else {
+        picohal_flush_output_bank();
+        picohal_check_ready(ms);
+    }
+
+    if(peek_message()) {
+        modbus_send(current_msg_ptr, &callbacks, false);
+        send_ms = ms;
+    }
+}
+
 static void picohal_rx_packet (modbus_message_t *msg)
 {
     //check the context/index and pop it off the queue if it matches.
     // sprintf(buf, "recv_context:%d current_context: %d",*((uint16_t*)msg->context), *((uint16_t*)current_msg_ptr->context));
     // report_message(buf, Message_Plain);
-    if(*((uint16_t*)msg->context) == *((uint16_t*)current_msg_ptr->context)){
+    if(picohal_is_front(msg->context)){
         dequeue_message();
+        //current_message still holds the request that was just acknowledged.
+        if(current_message.adu[1] == ModBus_ReadHoldingRegisters)
+            picohal_rx_registers(msg);
+        else if(events_in_flight && (picohal_get_register(&current_message.adu[2]) == PICOHAL_REG_EVENT ||
+                                      picohal_get_register(&current_message.adu[2]) == PICOHAL_REG_EVENT_FIFO))
+            picohal_events_acked();
+        picohal_send_next();
     }
     //else it should stay on the queue to be re-transmitted.
     
 }
 
-static void picohal_set_state ()
-{   
+static uint16_t picohal_get_state_code (void)
+{
     uint16_t data;
-    uint16_t alarm_code;
 
         switch (current_state){
         case STATE_ALARM:
@@ -174,6 +598,14 @@ static void picohal_set_state ()
             break;                                                        
     }
 
+    return data;
+}
+
+static void picohal_set_state ()
+{   
+    uint16_t data = picohal_get_state_code();
+    uint16_t alarm_code;
+
     modbus_message_t cmd = {
         .context = NULL,
         .crc_check = false,
@@ -186,7 +618,7 @@ static void picohal_set_state ()
         .tx_length = 8,
         .rx_length = 8
     };
-    enqueue_message(cmd);
+    enqueue_state_message(cmd);
 
     //if in alarm state, write the alarm code to the alarm register.
     if (data == STATE_ALARM){
@@ -205,7 +637,7 @@ static void picohal_set_state ()
             .tx_length = 8,
             .rx_length = 8
         };
-        enqueue_message(code_cmd); 
+        enqueue_state_message(code_cmd); 
     }
 
 }
@@ -225,7 +657,7 @@ static void picohal_set_coolant ()
         .tx_length = 8,
         .rx_length = 8
     };
-    enqueue_message(cmd);
+    enqueue_state_message(cmd);
 }
 
 static void picohal_set_IPG_output (IPG_state_t IPG_state)
@@ -243,7 +675,11 @@ static void picohal_set_IPG_output (IPG_state_t IPG_state)
         .tx_length = 8,
         .rx_length = 8
     };
-    enqueue_message(cmd);
+
+    if(IPG_state.mains || IPG_state.error_reset)    // momentary pulse, must not be superseded
+        enqueue_message(cmd);
+    else
+        enqueue_state_message(cmd);
 }
 
 static void picohal_set_BLC_output (BLC_state_t BLC_state)
@@ -261,12 +697,40 @@ static void picohal_set_BLC_output (BLC_state_t BLC_state)
         .tx_length = 8,
         .rx_length = 8
     };
-    enqueue_message(cmd);
+    enqueue_state_message(cmd);
 }
 
-static void picohal_set_BLC_flowrate (uint16_t BLC_flowrate)
-{       
-    //set BLC flowrate in register 0x121
+static void picohal_set_BLC_feeder_flowrate (uint_fast8_t feeder)
+{
+    //set UQ8.8 flowrate of a single feeder in register 0x122 or 0x123
+    uint16_t reg = PICOHAL_REG_POWDER1_FLOW + feeder;
+
+    modbus_message_t cmd = {
+        .context = NULL,
+        .crc_check = false,
+        .adu[0] = PICOHAL_ADDRESS,
+        .adu[1] = ModBus_WriteRegister,
+        .adu[2] = reg >> 8,
+        .adu[3] = reg & 0xFF,
+        .adu[4] = current_BLC_flowrate[feeder] >> 8,
+        .adu[5] = current_BLC_flowrate[feeder] & 0xFF,
+        .tx_length = 8,
+        .rx_length = 8
+    };
+    enqueue_state_message(cmd);
+}
+
+static void picohal_set_BLC_flowrate (void)
+{
+    if(picohal_caps.ext_flow) {
+        picohal_set_BLC_feeder_flowrate(0);
+        picohal_set_BLC_feeder_flowrate(1);
+        return;
+    }
+
+    //set legacy BLC flowrate in register 0x121, integer part of each feeder packed in one byte
+    uint16_t BLC_flowrate = (current_BLC_flowrate[0] >> 8) | (current_BLC_flowrate[1] & 0xFF00);
+
     modbus_message_t cmd = {
         .context = NULL,
         .crc_check = false,
@@ -279,28 +743,192 @@ static void picohal_set_BLC_flowrate (uint16_t BLC_flowrate)
         .tx_length = 8,
         .rx_length = 8
     };
-    enqueue_message(cmd);
+    enqueue_state_message(cmd);
 }
 
-static void picohal_create_event (picohal_events event){
+static void picohal_set_watchdog (uint16_t timeout)
+{
+    //set watchdog timeout in register 0x0007
+    modbus_message_t cmd = {
+        .context = NULL,
+        .crc_check = false,
+        .adu[0] = PICOHAL_ADDRESS,
+        .adu[1] = ModBus_WriteRegister,
+        .adu[2] = PICOHAL_REG_WATCHDOG >> 8,
+        .adu[3] = PICOHAL_REG_WATCHDOG & 0xFF,
+        .adu[4] = timeout >> 8,
+        .adu[5] = timeout & 0xFF,
+        .tx_length = 8,
+        .rx_length = 8
+    };
+    enqueue_state_message(cmd);
+}
+
+static void picohal_heartbeat (void)
+{
+    //write sequence counter to register 0x0006, the board only needs to see a valid frame
+    heartbeat_seq++;
 
     modbus_message_t cmd = {
         .context = NULL,
         .crc_check = false,
         .adu[0] = PICOHAL_ADDRESS,
         .adu[1] = ModBus_WriteRegister,
-        .adu[2] = 0x00,
-        .adu[3] = 0x05,
-        .adu[4] = event >> 8,
-        .adu[5] = event & 0xFF,
+        .adu[2] = PICOHAL_REG_HEARTBEAT >> 8,
+        .adu[3] = PICOHAL_REG_HEARTBEAT & 0xFF,
+        .adu[4] = heartbeat_seq >> 8,
+        .adu[5] = heartbeat_seq & 0xFF,
         .tx_length = 8,
         .rx_length = 8
     };
-    enqueue_message(cmd);
+    enqueue_state_message(cmd);
 }
+
+// Write the dirty output bank registers from 0x0400 while there is room in the queue, the rest
+// go out from the poll loop as the queue drains. Two slots are left for state and event writes.
+// Full values only, so a later write to the same register can safely replace a pending one.
+static void picohal_flush_output_bank (void)
+{
+    uint_fast8_t idx = 0, count;
+
+    while(output_bank_dirty && item_count < QUEUE_SIZE - 2) {
+
+        while(!(output_bank_dirty & (1UL << idx)))
+            idx++;
+
+#if PICOHAL_WRITE_REGS_MAX >= 2
+        for(count = 1; count < PICOHAL_WRITE_REGS_MAX && idx + count < PICOHAL_OUTPUT_REGS && (output_bank_dirty & (1UL << (idx + count))); count++);
+
+        if(!(count == 1
+              ? enqueue_state_message(picohal_register_write(PICOHAL_REG_OUTPUT_BANK + idx, current_output_bank[idx]))
+              : picohal_write_registers(PICOHAL_REG_OUTPUT_BANK + idx, &current_output_bank[idx], count)))
+            break;
+#else
+        count = 1;
+        if(!enqueue_state_message(picohal_register_write(PICOHAL_REG_OUTPUT_BANK + idx, current_output_bank[idx])))
+            break;
+#endif
+
+        output_bank_dirty &= ~(((1UL << count) - 1) << idx);
+        idx += count;
+    }
+}
+
+// Set count (1-16) consecutive channels starting at channel to the low bits of value.
+static void picohal_set_outputs (uint_fast16_t channel, uint_fast8_t count, uint16_t value)
+{
+    uint_fast8_t idx = channel / 16, shift = channel % 16;
+    uint32_t mask = ((1UL << count) - 1) << shift, bits = (uint32_t)value << shift;
+    uint16_t lo_mask = mask & 0xFFFF, hi_mask = mask >> 16;
+
+    current_output_bank[idx] = (current_output_bank[idx] & ~lo_mask) | (bits & lo_mask);
+    output_bank_dirty |= 1UL << idx;
+
+    //channels span two registers, written in one frame if the ADU buffer allows.
+    if(hi_mask) {
+        current_output_bank[idx + 1] = (current_output_bank[idx + 1] & ~hi_mask) | ((bits >> 16) & hi_mask);
+        output_bank_dirty |= 1UL << (idx + 1);
+    }
+
+    picohal_flush_output_bank();
+}
+
+static void picohal_sync_state (void)
+{
+    //push the complete output state, in a single frame if the firmware has a state image.
+    //That frame needs an ADU of 9 + 2 * PICOHAL_STATE_BLOCK_SIZE bytes, more than the stock core
+    //buffer of 10, so stock builds write the registers one by one. These frames go out back to
+    //back from picohal_send_next(), not at the polling rate.
+    uint16_t values[PICOHAL_STATE_BLOCK_SIZE] = {
+        picohal_get_state_code(),
+        (uint16_t)sys.alarm,
+        current_coolant_state.value & 0xFF,
+        current_IPG_state.value & 0xFF,
+        current_BLC_state.value & 0xFF,
+        current_BLC_flowrate[0],
+        current_BLC_flowrate[1]
+    };
+
+    picohal_link = PicoHAL_Syncing;
+
+    if(picohal_caps.watchdog)
+        picohal_set_watchdog(PICOHAL_WATCHDOG_TIMEOUT);
+
+    if(picohal_caps.state_block && picohal_write_registers(PICOHAL_REG_STATE_BLOCK, values, PICOHAL_STATE_BLOCK_SIZE))
+        coolant_before = current_coolant_state;
+    else {
+        picohal_set_state();
+        picohal_set_IPG_output(current_IPG_state);
+        picohal_set_BLC_flowrate();
+        picohal_set_BLC_output(current_BLC_state);
+    }
+
+    //open debounce windows must compare against what was just sent, not what was sent before.
+    state_before = current_state;
+
+    //the board cleared the bank at handshake, only channels set since need to be sent again.
+    //The bank goes last, it only takes what is left of the queue and drains from picohal_send_next().
+    if(picohal_caps.output_bank) {
+        uint_fast8_t idx;
+
+        for(idx = 0; idx < PICOHAL_OUTPUT_REGS; idx++) {
+            if(current_output_bank[idx])
+                output_bank_dirty |= 1UL << idx;
+        }
+        picohal_flush_output_bank();
+    }
+}
+
+#if PICOHAL_WRITE_REGS_MAX < 2
+static inline bool picohal_is_rpm_word (uint_fast8_t pos, uint16_t reg)
+{
+    return message_queue[pos].picohal_packet.adu[1] == ModBus_WriteRegister &&
+            picohal_get_register(&message_queue[pos].picohal_packet.adu[2]) == reg;
+}
+#endif
+
+static void picohal_set_RPM32 (uint32_t rpm_value)
+{
+    uint16_t values[2] = { rpm_value >> 16, rpm_value & 0xFFFF };
+
+#if PICOHAL_WRITE_REGS_MAX >= 2
+    //write 32-bit speed to registers 0x202 and 0x203 in a single frame
+    picohal_write_registers(PICOHAL_REG_SPINDLE_RPM32, values, 2);
+#else
+    //the ADU buffer is too small for a single frame, write the high word to 0x202 then the low word to 0x203.
+    //The board latches the speed on the low word so the pair must stay together and in order.
+    //update the pair in place only when it is the last thing queued, and its high word is not the front
+    //that may already be in flight. Anything queued after the pair must still reach the board after it.
+    if(item_count > 2) {
+        uint_fast8_t pos = (front + item_count - 1) % QUEUE_SIZE, prev = (pos + QUEUE_SIZE - 1) % QUEUE_SIZE;
+        if(picohal_is_rpm_word(pos, PICOHAL_REG_SPINDLE_RPM32 + 1) && picohal_is_rpm_word(prev, PICOHAL_REG_SPINDLE_RPM32)) {
+            message_queue[prev].picohal_packet.adu[4] = values[0] >> 8;
+            message_queue[prev].picohal_packet.adu[5] = values[0] & 0xFF;
+            message_queue[pos].picohal_packet.adu[4] = values[1] >> 8;
+            message_queue[pos].picohal_packet.adu[5] = values[1] & 0xFF;
+            return;
+        }
+    }
+
+    if(item_count > QUEUE_SIZE - 2) {   // both words or neither
+        report_message("Warning: PicoHAL queue is full.", Message_Warning);
+        return;
+    }
+
+    enqueue_message(picohal_register_write(PICOHAL_REG_SPINDLE_RPM32, values[0]));
+    enqueue_message(picohal_register_write(PICOHAL_REG_SPINDLE_RPM32 + 1, values[1]));
+#endif
+}
+
 static void spindleSetRPM (float rpm, bool block)
 {
-    uint16_t rpm_value = (uint16_t)rpm; // convert float to integer
+    if(picohal_caps.ext_rpm) {
+        float scaled = rpm * PICOHAL_RPM_SCALE;
+        picohal_set_RPM32(scaled <= 0.0f ? 0 : (scaled >= (float)UINT32_MAX ? UINT32_MAX : (uint32_t)(scaled + 0.5f)));
+        return;
+    }
+
+    uint16_t rpm_value = rpm <= 0.0f ? 0 : (rpm >= 65535.0f ? 0xFFFF : (uint16_t)rpm); // convert float to integer
 
     modbus_message_t mode_cmd = {
         .context = NULL,
@@ -315,7 +943,7 @@ static void spindleSetRPM (float rpm, bool block)
         .rx_length = 8
     };
 
-    enqueue_message(mode_cmd);
+    enqueue_state_message(mode_cmd);
 }
 
 static void spindleSetSpeed (spindle_ptrs_t *spindle, float rpm)
@@ -346,7 +974,7 @@ static void spindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, flo
     spindle_state.on = state.on;
     spindle_state.ccw = state.ccw;
 
-    if(enqueue_message(mode_cmd))
+    if(enqueue_state_message(mode_cmd))
         spindleSetRPM(rpm, false);
 }
 
@@ -363,6 +991,67 @@ static spindle_state_t spindleGetState (spindle_ptrs_t *spindle)
     system_raise_alarm(Alarm_Spindle);
 } */
 
+static char *picohal_append_hex (char *s, uint16_t value)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    uint_fast8_t shift = 16;
+
+    *s++ = '0';
+    *s++ = 'x';
+    do {
+        shift -= 4;
+        *s++ = digits[(value >> shift) & 0x0F];
+    } while(shift);
+    *s = '\0';
+
+    return s;
+}
+
+// Reports "<prefix><code> x<code count>, reg 0x<reg> x<reg count>", built in a static buffer without printf.
+static void picohal_report_exception (const char *prefix, uint8_t code, uint16_t code_count, uint16_t reg, uint16_t reg_count)
+{
+    static char buf[72];
+
+    strcpy(buf, prefix);
+    strcat(buf, uitoa(code));
+    if(code_count > 1) {
+        strcat(buf, " x");
+        strcat(buf, uitoa(code_count));
+    }
+    strcat(buf, ", reg ");
+    picohal_append_hex(buf + strlen(buf), reg);
+    if(reg_count > 1) {
+        strcat(buf, " x");
+        strcat(buf, uitoa(reg_count));
+    }
+
+    report_message(buf, Message_Warning);
+}
+
+static void picohal_report_exceptions (void)
+{
+    static char prefix[40];
+    uint_fast8_t idx, code = 0, slot = 0;
+
+    //summarize the most frequent code and register, then start counting afresh.
+    for(idx = 1; idx < PICOHAL_EXCEPTION_CODES; idx++) {
+        if(exceptions.code[idx] > exceptions.code[code])
+            code = idx;
+    }
+    for(idx = 1; idx < PICOHAL_EXCEPTION_REGS; idx++) {
+        if(exceptions.reg[idx].count > exceptions.reg[slot].count)
+            slot = idx;
+    }
+
+    strcpy(prefix, "PicoHAL: ");
+    strcat(prefix, uitoa(exceptions.total));
+    strcat(prefix, " Modbus exceptions, code ");
+
+    picohal_report_exception(prefix, code, exceptions.code[code], exceptions.reg[slot].reg, exceptions.reg[slot].count);
+
+    memset(&exceptions, 0, sizeof(exceptions));
+}
+
 static void picohal_rx_exception (uint8_t code, void *context)
 {
     // if(sys.cold_start) // is this necessary? Copied from vfd
@@ -370,30 +1059,108 @@ static void picohal_rx_exception (uint8_t code, void *context)
     // else
     //     system_raise_alarm(Alarm_Spindle);
 
-    uint8_t value = *((uint8_t*)context);
-    char buf[16];
+    //also when a reset queued a second handshake and the first one already completed.
+    if(picohal_is_front(context) &&
+        current_message.adu[1] == ModBus_ReadHoldingRegisters &&
+         picohal_get_register(&current_message.adu[2]) >= PICOHAL_REG_DEVICE_ID &&
+          picohal_get_register(&current_message.adu[2]) <= PICOHAL_REG_CAPABILITIES) {
+
+        uint16_t reg = picohal_get_register(&current_message.adu[2]);
+
+        if(code == PICOHAL_EXCEPTION_ILLEGAL_FUNCTION || code == PICOHAL_EXCEPTION_ILLEGAL_ADDRESS) {
+            //firmware without the device info block rejects the read, fall back to legacy encodings.
+            dequeue_message();
+            if(reg + (uint8_t)current_message.adu[5] > PICOHAL_REG_CAPABILITIES) {
+                picohal_caps.value = 0;
+                picohal_handshake_completed();
+            }
+            picohal_send_next();
+            return;
+        }
 
-    report_message("picohal_rx_exception", Message_Warning);
-    sprintf(buf, "CODE: %d", code);
-    report_message(buf, Message_Plain);   
-    sprintf(buf, "CONT: %d", value);
-    report_message(buf, Message_Plain);             
-    //if RX exceptions during one of the messages, need to retry?
+        if(++handshake_retries == PICOHAL_RETRIES)
+            report_message("PicoHAL: no response to handshake, check wiring and address", Message_Warning);
+    }
+
+    //the message stays on the queue and is retried, just account for the exception here.
+    uint_fast8_t idx;
+    uint16_t reg = picohal_is_front(context) ? picohal_get_register(&message_queue[front].picohal_packet.adu[2]) : 0xFFFF;
+
+    if(exceptions.total < UINT16_MAX)
+        exceptions.total++;
+
+    idx = min(code, PICOHAL_EXCEPTION_CODES - 1);
+    if(exceptions.code[idx] < UINT16_MAX)
+        exceptions.code[idx]++;
+
+    for(idx = 0; idx < PICOHAL_EXCEPTION_REGS; idx++) {
+        if(exceptions.reg[idx].count == 0)
+            exceptions.reg[idx].reg = reg;
+        if(exceptions.reg[idx].reg == reg) {
+            if(exceptions.reg[idx].count < UINT16_MAX)
+                exceptions.reg[idx].count++;
+            break;
+        }
+    }
+
+#if PICOHAL_EXCEPTION_TRACE
+    picohal_report_exception("PicoHAL exception: code ", code, 1, reg, 1);
+#endif
+}
+
+static void picohal_flush_changes (uint32_t ms)
+{
+    if(coolant_pending && ms - coolant_ms >= PICOHAL_DEBOUNCE_WINDOW) {
+        coolant_pending = false;
+        if(current_coolant_state.value != coolant_before.value)
+            picohal_set_coolant();
+    }
+
+    if(state_pending && ms - state_ms >= PICOHAL_DEBOUNCE_WINDOW) {
+        state_pending = false;
+        if(current_state != state_before)
+            picohal_set_state();
+    }
 }
 
 static void picohal_poll (void)
 {
-    static uint32_t last_ms;
+    static uint32_t exception_ms;
     uint32_t ms = hal.get_elapsed_ticks();
 
+    picohal_flush_changes(ms);
+
+    //at most one exception summary per interval, however noisy the line is.
+    if(exceptions.total && ms - exception_ms >= PICOHAL_EXCEPTION_REPORT_INTERVAL) {
+        picohal_report_exceptions();
+        exception_ms = ms;
+    }
+
     //control the rate at which the queue is emptied to avoid filling the modbus queue
-    if(ms < last_ms + POLLING_INTERVAL)
+    if(ms < send_ms + POLLING_INTERVAL)
         return;    
 
+    //the handshake reads were dropped on a full queue, ask again now that it has drained.
+    if(item_count == 0 && picohal_link == PicoHAL_Handshake)
+        picohal_get_device_info();
+
+    picohal_flush_output_bank();
+    picohal_send_events();
+
+    picohal_check_ready(ms);
+
+    //analog reads are low priority, queued behind pending writes and only while there is room
+    //to spare. Still once per interval, so continuous writes can not starve them.
+    if(item_count < QUEUE_SIZE - 2 && picohal_link == PicoHAL_Ready && picohal_caps.analog_in)
+        picohal_read_analog(ms);
+
     //if there is a message try to send it.
     if(item_count){
         picohal_send();
-        last_ms = ms;
+        send_ms = ms;
+    } else if(picohal_caps.watchdog && ms - send_ms >= PICOHAL_HEARTBEAT_INTERVAL) {
+        //regular traffic feeds the watchdog, only send a heartbeat when the bus has been idle.
+        picohal_heartbeat();
     }
 }
 
@@ -409,6 +1176,7 @@ static void picohal_poll_delay (sys_state_t grbl_state)
     picohal_poll();
 }
 
+
 // check - check if M-code is handled here.
 static user_mcode_type_t check (user_mcode_t mcode)
 {
@@ -420,7 +1188,8 @@ static user_mcode_type_t check (user_mcode_t mcode)
             (picohal_mcode_t)mcode == Powder1_On || (picohal_mcode_t)mcode == Powder1_Off ||
             (picohal_mcode_t)mcode == Powder2_On || (picohal_mcode_t)mcode == Powder2_Off ||
             (picohal_mcode_t)mcode == PowderSwitch_On || (picohal_mcode_t)mcode == PowderSwitch_Off ||
-            (picohal_mcode_t)mcode == Powder1_FlowRate || (picohal_mcode_t)mcode == Powder2_FlowRate
+            (picohal_mcode_t)mcode == Powder1_FlowRate || (picohal_mcode_t)mcode == Powder2_FlowRate ||
+            (picohal_mcode_t)mcode == OutputBank_Set
             )
                      ? UserMCode_Normal //  Handled by us. Set to UserMCode_NoValueWords if there are any parameter words (letters) without an accompanying value.
                      : (user_mcode.check ? user_mcode.check(mcode) : UserMCode_Unsupported);	// If another handler present then call it or return ignore.
@@ -445,6 +1214,10 @@ static status_code_t validate (parser_block_t *gc_block)
             break;
         case LaserGuide_Off:
             break;
+        case LaserShutter_On:
+            break;
+        case LaserShutter_Off:
+            break;
         case Argon_On:
             break;
         case Argon_Off:
@@ -463,11 +1236,12 @@ static status_code_t validate (parser_block_t *gc_block)
             break;
         case Powder1_FlowRate:
         case Powder2_FlowRate:
-            if(gc_block->words.q && isnan(gc_block->values.q))          // Check if Q parameter value is supplied.
-            state = Status_BadNumberFormat;                             // Return error if not.        
-
-            if(state != Status_BadNumberFormat && gc_block->words.q) {          // Are required parameters provided?
-                if(gc_block->values.q >= 10.0f && gc_block->values.q <= 150.0f) // Yes, is Q parameter value in range (0-150)?
+            if(!gc_block->words.q)                                      // Check if Q parameter is supplied.
+                state = Status_GcodeValueWordMissing;                   // Return error if not.
+            else if(isnan(gc_block->values.q))                          // Check if Q parameter value is supplied.
+                state = Status_BadNumberFormat;                         // Return error if not.
+            else {                                                      // Required parameters provided.
+                if(gc_block->values.q >= 10.0f && gc_block->values.q <= 150.0f) // Yes, is Q parameter value in range (10-150)?
                     state = Status_OK;                                          // Yes - return ok status.
                 else
                     state = Status_GcodeValueOutOfRange;                    // No - return error status.
@@ -475,6 +1249,27 @@ static status_code_t validate (parser_block_t *gc_block)
                 gc_block->user_mcode_sync = true;                           // Optional: execute command synchronized
             }
             break;
+        case OutputBank_Set:
+            if(!picohal_caps.output_bank)                               // Firmware without output bank?
+                state = Status_GcodeUnsupportedCommand;
+            else if(!(gc_block->words.p && gc_block->words.q))          // Check if P and Q parameters are supplied.
+                state = Status_GcodeValueWordMissing;
+            else if(isnan(gc_block->values.p) || isnan(gc_block->values.q))
+                state = Status_BadNumberFormat;
+            else {
+                uint32_t count = gc_block->words.l ? gc_block->values.l : 1;   // range checked below, before any narrowing
+
+                gc_block->values.l = count;                             // Keep channel count for execute, L is claimed below.
+
+                if(gc_block->values.p < 0.0f || gc_block->values.p != truncf(gc_block->values.p) ||
+                    count < 1 || count > 16 || gc_block->values.p + count > PICOHAL_OUTPUT_CHANNELS ||
+                     gc_block->values.q < 0.0f || gc_block->values.q != truncf(gc_block->values.q) ||
+                      gc_block->values.q >= (float)(1UL << count))
+                    state = Status_GcodeValueOutOfRange;
+                gc_block->words.p = gc_block->words.q = gc_block->words.l = Off;  // Claim parameters.
+                gc_block->user_mcode_sync = true;
+            }
+            break;
         default:
             state = Status_Unhandled;
             break;
@@ -562,12 +1357,21 @@ static void execute (sys_state_t state, parser_block_t *gc_block)
             picohal_set_BLC_output(current_BLC_state);
             break;
         case Powder1_FlowRate:
-            current_BLC_flowrate = (current_BLC_flowrate & 0XFF00) | ((uint16_t)gc_block->values.q & 0X00FF);
-            picohal_set_BLC_flowrate(current_BLC_flowrate);
+            current_BLC_flowrate[0] = (uint16_t)(gc_block->values.q * PICOHAL_FLOW_SCALE + 0.5f);
+            if(picohal_caps.ext_flow)
+                picohal_set_BLC_feeder_flowrate(0);
+            else
+                picohal_set_BLC_flowrate();
             break;
         case Powder2_FlowRate:
-            current_BLC_flowrate = (current_BLC_flowrate & 0X00FF) | ((uint16_t)gc_block->values.q << 8);
-            picohal_set_BLC_flowrate(current_BLC_flowrate);
+            current_BLC_flowrate[1] = (uint16_t)(gc_block->values.q * PICOHAL_FLOW_SCALE + 0.5f);
+            if(picohal_caps.ext_flow)
+                picohal_set_BLC_feeder_flowrate(1);
+            else
+                picohal_set_BLC_flowrate();
+            break;
+        case OutputBank_Set:
+            picohal_set_outputs((uint_fast16_t)gc_block->values.p, gc_block->values.l, (uint16_t)gc_block->values.q);
             break;
         default:
             handled = false;
@@ -589,8 +1393,12 @@ static void onReportOptions (bool newopt)
 
 static void onCoolantChanged (coolant_state_t state){
 
+    if(!coolant_pending) {          // open the debounce window, flushed from picohal_poll
+        coolant_pending = true;
+        coolant_before = current_coolant_state;
+        coolant_ms = hal.get_elapsed_ticks();
+    }
     current_coolant_state = state;
-    picohal_set_coolant();
 
     if (on_coolant_changed)         // Call previous function in the chain.
         on_coolant_changed(state);    
@@ -598,8 +1406,24 @@ static void onCoolantChanged (coolant_state_t state){
 
 static void onStateChanged (sys_state_t state)
 {
-    current_state = state;
-    picohal_set_state();
+    if(state == STATE_ALARM || state == STATE_ESTOP) {
+        //alarms bypass the debounce window, pending coolant changes go out with them.
+        current_state = state;
+        state_pending = false;
+        picohal_set_state();
+        if(coolant_pending) {
+            coolant_pending = false;
+            picohal_set_coolant();
+        }
+    } else {
+        if(!state_pending) {        // open the debounce window, flushed from picohal_poll
+            state_pending = true;
+            state_before = current_state;
+            state_ms = hal.get_elapsed_ticks();
+        }
+        current_state = state;
+    }
+
     if (on_state_change)         // Call previous function in the chain.
         on_state_change(state);    
 }
@@ -615,6 +1439,46 @@ static void onProgramCompleted (program_flow_t program_flow, bool check_mode)
         on_program_completed(program_flow, check_mode);
 }
 
+static void onHomingCompleted (axes_signals_t homing_cycle, bool success)
+{
+    if(success)
+        picohal_create_event(HOMING_COMPLETED);
+
+    if(on_homing_completed)
+        on_homing_completed(homing_cycle, success);
+}
+
+static bool onProbeStart (axes_signals_t axes, float *target, plan_line_data_t *pl_data)
+{
+    picohal_create_event(PROBE_START);
+
+    return on_probe_start == NULL || on_probe_start(axes, target, pl_data);
+}
+
+static void onProbeCompleted (void)
+{
+    picohal_create_event(PROBE_COMPLETED);
+
+    if(on_probe_completed)
+        on_probe_completed();
+}
+
+static bool onProbeFixture (tool_data_t *tool, bool at_g59_3, bool on)
+{
+    if(on)
+        picohal_create_event(PROBE_FIXTURE);
+
+    return on_probe_fixture == NULL || on_probe_fixture(tool, at_g59_3, on);
+}
+
+static void onToolChangeAck (void)
+{
+    picohal_create_event(TOOLCHANGE_ACK);
+
+    if(on_toolchange_ack)
+        on_toolchange_ack();
+}
+
 static void picohal_realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
 {
     if(on_realtime_report)
@@ -647,10 +1511,12 @@ static void onSpindleSelected (spindle_ptrs_t *spindle)
 // DRIVER RESET
 static void onDriverReset (void)
 {
-    picohal_set_state();
-    picohal_set_IPG_output((IPG_state_t){0});
-    picohal_set_BLC_flowrate(current_BLC_flowrate);
-    picohal_set_BLC_output((BLC_state_t){0});
+    reset_ms = hal.get_elapsed_ticks();
+    current_IPG_state.value = 0;
+    current_BLC_state.value = 0;
+    memset(current_output_bank, 0, sizeof(current_output_bank));
+    output_bank_dirty = 0;
+    picohal_get_device_info();  // initial state is pushed when the handshake completes
     driver_reset();
 }
 
@@ -716,7 +1582,7 @@ void picohal_init (void)
     on_coolant_changed = hal.coolant.set_state;         //subscribe to coolant events
     hal.coolant.set_state = onCoolantChanged;
 
-    on_realtime_report = grbl.on_realtime_report;       //keepalive
+    on_realtime_report = grbl.on_realtime_report;
     grbl.on_realtime_report = picohal_realtime_report;
 
     on_execute_realtime = grbl.on_execute_realtime;
@@ -728,6 +1594,21 @@ void picohal_init (void)
     on_program_completed = grbl.on_program_completed;   // Subscribe to on program completed events (lightshow on complete?)
     grbl.on_program_completed = onProgramCompleted;     // Checkered Flag for successful end of program lives here
 
+    on_homing_completed = grbl.on_homing_completed;     // Subscribe to homing, probing and tool change events
+    grbl.on_homing_completed = onHomingCompleted;       // for the lightshow/automation on the board.
+
+    on_probe_start = grbl.on_probe_start;
+    grbl.on_probe_start = onProbeStart;
+
+    on_probe_completed = grbl.on_probe_completed;
+    grbl.on_probe_completed = onProbeCompleted;
+
+    on_probe_fixture = grbl.on_probe_fixture;
+    grbl.on_probe_fixture = onProbeFixture;
+
+    on_toolchange_ack = grbl.on_toolchange_ack;
+    grbl.on_toolchange_ack = onToolChangeAck;
+
     driver_reset = hal.driver_reset;                    // Subscribe to driver reset event
     hal.driver_reset = onDriverReset;
 
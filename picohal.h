@@ -29,22 +29,102 @@
 #include "../grbl/state_machine.h"
 #include "../grbl/report.h"
 #include "../grbl/modbus.h"
+#include "../grbl/ioports.h"
 #else
 #include "grbl/hal.h"
 #include "grbl/protocol.h"
 #include "grbl/state_machine.h"
 #include "grbl/report.h"
 #include "grbl/modbus.h"
+#include "grbl/ioports.h"
 #include "driver.h"
 #endif
 
 #define PICOHAL_ADDRESS 10
-#define QUEUE_SIZE 8
+#define QUEUE_SIZE 16        // State sync alone takes up to 7 frames with the stock ADU size
 
 #define RETRY_DELAY         250
 #define POLLING_INTERVAL    100
 #define PICOHAL_RETRIES     5
 
+#ifndef PICOHAL_HEARTBEAT_INTERVAL
+#define PICOHAL_HEARTBEAT_INTERVAL  500     // Bus idle time (ms) before a heartbeat frame is sent
+#endif
+#ifndef PICOHAL_WATCHDOG_TIMEOUT
+#define PICOHAL_WATCHDOG_TIMEOUT    2000    // Time (ms) without any valid frame before the board drops IPG/BLC outputs
+#endif
+
+#ifndef PICOHAL_DEBOUNCE_WINDOW
+#define PICOHAL_DEBOUNCE_WINDOW     20      // Time (ms) coolant and state changes are collected before the net change is sent
+#endif
+#ifndef PICOHAL_EXCEPTION_REPORT_INTERVAL
+#define PICOHAL_EXCEPTION_REPORT_INTERVAL 5000  // Min time (ms) between exception summary messages
+#endif
+#ifndef PICOHAL_EXCEPTION_TRACE
+#define PICOHAL_EXCEPTION_TRACE     0       // Set to 1 to also report every single exception
+#endif
+#define PICOHAL_EXCEPTION_CODES     12      // Exception counters by code, higher codes share the last one
+#define PICOHAL_EXCEPTION_REGS      4       // Exception counters by register
+
+#if PICOHAL_HEARTBEAT_INTERVAL + POLLING_INTERVAL >= PICOHAL_WATCHDOG_TIMEOUT / 2
+#error "PicoHAL: watchdog timeout must exceed twice the heartbeat plus polling interval"
+#endif
+
+#define PICOHAL_REG_HEARTBEAT       0x0006  // Sequence counter, written only when the bus is idle
+#define PICOHAL_REG_WATCHDOG        0x0007  // Watchdog timeout in ms, 0 disables
+#define PICOHAL_REG_EVENT           0x0005  // Legacy single event register
+#define PICOHAL_REG_DEVICE_ID       0x0010
+#define PICOHAL_REG_FW_VERSION      0x0011
+#define PICOHAL_REG_CAPABILITIES    0x0012
+#define PICOHAL_REG_STATE_BLOCK     0x0020  // Status, alarm, coolant, IPG, BLC, powder 1 and 2 flow
+#define PICOHAL_STATE_BLOCK_SIZE    7
+#define PICOHAL_REG_EVENT_FIFO      0x0040  // Event records, (sequence << 8) | event
+#define PICOHAL_REG_POWDER1_FLOW    0x0122  // UQ8.8 flow rate, powder 2 follows at 0x0123
+#define PICOHAL_REG_SPINDLE_RPM32   0x0202  // 32-bit speed, high word first, low word at 0x0203.
+                                            // The board holds the high word and latches the speed when the low word is written.
+#define PICOHAL_REG_ANALOG_IN       0x0300  // Flow, pressure and temperature inputs
+#define PICOHAL_REG_OUTPUT_BANK     0x0400  // Relay shield channels, 16 per register, channel 0 is bit 0 of 0x0400.
+                                            // The board clears all channels when the device ID is read at handshake.
+
+#define PICOHAL_DEVICE_ID           0x5048  // "PH"
+#define PICOHAL_FW_VERSION_MAJOR    1       // Firmware major version (high byte) this plugin speaks to
+#define PICOHAL_INFO_BLOCK_SIZE     3       // Device ID, firmware version and capabilities
+
+#define PICOHAL_EVENT_QUEUE_SIZE    16
+#define PICOHAL_EVENT_BATCH         8       // Max event records per frame, batches need MODBUS_MAX_ADU_SIZE >= 13.
+                                            // With the stock size of 10 each record is a single register write.
+
+#ifndef PICOHAL_ANALOG_INPUTS
+#define PICOHAL_ANALOG_INPUTS       3       // Number of board analog inputs exposed as aux analog ports
+#endif
+#ifndef PICOHAL_ANALOG_INTERVAL
+#define PICOHAL_ANALOG_INTERVAL     1000    // Background refresh interval (ms) of the analog input cache
+#endif
+#ifndef PICOHAL_ANALOG_MAX_AGE
+#define PICOHAL_ANALOG_MAX_AGE      (3 * PICOHAL_ANALOG_INTERVAL)   // Cached analog values older than this (ms) read as -1
+#endif
+
+#ifndef PICOHAL_OUTPUT_CHANNELS
+#define PICOHAL_OUTPUT_CHANNELS     64      // Number of relay shield channels in the output bank
+#endif
+#define PICOHAL_OUTPUT_REGS         ((PICOHAL_OUTPUT_CHANNELS + 15) / 16)
+
+#if PICOHAL_OUTPUT_REGS > 32
+#error "PICOHAL_OUTPUT_CHANNELS can not exceed 512"
+#endif
+
+#define PICOHAL_FLOW_SCALE  256.0f          // Extended flow rate is Q * 256
+#define PICOHAL_RPM_SCALE   100.0f          // Extended spindle speed is in 0.01 RPM units
+
+// Number of registers that fit in a single frame with the core ADU buffer size,
+// extended encodings that need more than this are not negotiated.
+#define PICOHAL_READ_REGS_MAX   ((MODBUS_MAX_ADU_SIZE - 5) / 2)
+#define PICOHAL_WRITE_REGS_MAX  ((MODBUS_MAX_ADU_SIZE - 9) / 2)
+
+// Modbus exception codes returned by firmware that lacks a register or function.
+#define PICOHAL_EXCEPTION_ILLEGAL_FUNCTION  1
+#define PICOHAL_EXCEPTION_ILLEGAL_ADDRESS   2
+
 typedef enum {
     LaserReady_On   = 510,
     LaserReady_Off  = 511,
@@ -66,7 +146,10 @@ typedef enum {
     PowderSwitch_Off = 527,
 
     Powder1_FlowRate = 501,
-    Powder2_FlowRate = 502
+    Powder2_FlowRate = 502,
+
+    OutputBank_Set = 530    // M530 P<first channel> Q<channel bits> [L<channel count, 1-16>]
+                            // Channels crossing a 16 channel register boundary take two frames with the stock ADU size.
 } picohal_mcode_t;
 
 typedef enum {
@@ -114,6 +197,29 @@ typedef union {
     };
 } BLC_state_t;
 
+typedef enum {
+    PicoHAL_Offline = 0,
+    PicoHAL_Handshake,
+    PicoHAL_Syncing,
+    PicoHAL_Ready
+} picohal_link_t;
+
+typedef union {
+    uint16_t bits;                 //!< Bitmask bits
+    uint16_t mask;                 //!< Bitmask
+    uint16_t value;                //!< Bitmask value
+    struct {
+        uint16_t ext_flow      :1, //!< Per feeder UQ8.8 flow rate registers
+                 ext_rpm       :1, //!< 32-bit spindle speed register pair
+                 state_block   :1, //!< Contiguous state image for single frame sync
+                 watchdog      :1, //!< Any valid frame feeds the watchdog, IPG/BLC outputs drop on timeout
+                 event_fifo    :1, //!< Sequenced event records
+                 analog_in     :1, //!< Analog input registers
+                 output_bank   :1, //!< Relay shield output bank
+                 unused        :9;
+    };
+} picohal_capabilities_t;
+
 void picohal_init (void);
 
 /**/
@@ -0,0 +1,1026 @@
+/*
+
+  picohal_fuzz.c
+
+  Part of grblHAL picohal plugin
+
+  Property test and libFuzzer target for the message queue and the M-code hooks.
+
+  picohal.c is built against stub core headers and talks to a model of the board.
+  Each input is decoded into an interleaving of responses, exceptions, stale responses,
+  M-code blocks, core events and resets. Before anything that queues writes the harness
+  answers frames until the queue has room, so the queue never overflows. Queue bounds and
+  frame layout are checked after every step, M501/M502/M530 validation against the
+  documented rules. A pending write may only be updated in place while nothing queued
+  before the update follows it, and frames must reach the board in the order they were
+  queued. When the queue is drained the board must hold the same outputs as a reference
+  model driven by the same input, i.e. nothing was lost or reordered.
+
+  Build with -DPICOHAL_LIBFUZZER and -fsanitize=fuzzer for libFuzzer, otherwise main()
+  runs a fixed number of pseudo random inputs.
+
+  GrblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  GrblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "../picohal.c"
+
+#define FUZZ_EVENTS_MAX     512
+#define FUZZ_DRAIN_POLLS    2000
+#define FUZZ_QUEUE_DEPTH    4       // Max pending frames before an operation that queues writes, 2 while the link comes up
+
+#define IPG_MOMENTARY       0x12    // mains and error reset bits, pulses rather than state
+
+#define FUZZ_CHECK(cond, msg) do { if(!(cond)) fuzz_fail(msg, __LINE__); } while(0)
+
+grbl_t grbl;
+hal_t hal;
+system_t sys;
+
+static const uint8_t *input;
+static size_t input_left;
+
+static uint32_t now_ms = 0;     // never rewound, picohal_poll keeps its last send time across runs
+static const spindle_ptrs_t *spindle_ptrs;
+static io_analog_t *analog_ports_added;
+static modbus_message_t on_wire;
+static bool frame_pending;
+
+// Queue contents after the previous step, to tell which pending frames were updated in place.
+static struct {
+    uint16_t index;
+    bool updated;
+    modbus_message_t frame;
+} queued[QUEUE_SIZE];
+static uint_fast8_t queued_count;
+
+// Model of the board: registers, the speed and flow they encode, pulses and the event log.
+static struct {
+    bool legacy;
+    picohal_capabilities_t caps;
+    uint16_t reg[0x0500];
+    uint16_t flow[2];
+    uint32_t speed;             // 0.01 RPM
+    uint16_t rpm_hi;
+    uint16_t analog[PICOHAL_ANALOG_INPUTS];
+    uint32_t mains_pulses, reset_pulses;
+    uint16_t event[FUZZ_EVENTS_MAX];
+    bool event_record[FUZZ_EVENTS_MAX];
+    uint_fast16_t events;
+    bool answered;
+    uint16_t last_index;        // queue index of the last frame answered
+} board;
+
+// Reference model: what the board should hold once everything has been sent.
+static struct {
+    IPG_state_t ipg;
+    BLC_state_t blc;
+    uint16_t flow[2];
+    uint16_t bank[PICOHAL_OUTPUT_REGS];
+    coolant_state_t coolant;
+    sys_state_t state;
+    uint32_t mains_pulses, reset_pulses;
+    uint8_t event[FUZZ_EVENTS_MAX];
+    uint_fast16_t events;
+    bool spindle_set;
+    uint16_t spindle_mode;
+    uint32_t speed;             // 0.01 RPM, legacy speeds are whole RPM
+} model;
+
+static void fuzz_fail (const char *msg, int line)
+{
+    fprintf(stderr, "picohal_fuzz:%d: %s (front %u, items %u, link %u, caps 0x%04X, adu %u)\n", line, msg,
+             (unsigned)front, (unsigned)item_count, (unsigned)picohal_link, (unsigned)picohal_caps.value, (unsigned)MODBUS_MAX_ADU_SIZE);
+    abort();
+}
+
+static uint8_t fuzz_byte (void)
+{
+    if(input_left == 0)
+        return 0;
+
+    input_left--;
+
+    return *input++;
+}
+
+/* Core stubs */
+
+static uint32_t get_elapsed_ticks (void)
+{
+    return now_ms;
+}
+
+char *uitoa (uint32_t n)
+{
+    static char buf[11];
+
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)n);
+
+    return buf;
+}
+
+spindle_id_t spindle_register (const spindle_ptrs_t *spindle, const char *name)
+{
+    UNUSED(name);
+
+    spindle_ptrs = spindle;
+
+    return 0;
+}
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data)
+{
+    fn(data);
+
+    return true;
+}
+
+void report_message (const char *msg, message_type_t type)
+{
+    UNUSED(type);
+
+    FUZZ_CHECK(!strstr(msg, "PicoHAL queue is full"), "queue overflowed");
+}
+
+void report_warning (void *message)
+{
+    UNUSED(message);
+}
+
+bool ioports_add_analog (io_analog_t *ports)
+{
+    analog_ports_added = ports;
+
+    return true;
+}
+
+static void core_write (const char *s)
+{
+    UNUSED(s);
+}
+
+static void core_noop (void)
+{
+}
+
+static void core_report_options (bool newopt)
+{
+    UNUSED(newopt);
+}
+
+static void core_execute_realtime (sys_state_t state)
+{
+    UNUSED(state);
+}
+
+/* Frames */
+
+static void check_frame (const modbus_message_t *msg)
+{
+    uint_fast8_t count = (uint8_t)msg->adu[5];
+
+    FUZZ_CHECK(msg->adu[0] == PICOHAL_ADDRESS, "frame for another address");
+    FUZZ_CHECK(msg->tx_length <= MODBUS_MAX_ADU_SIZE && msg->rx_length <= MODBUS_MAX_ADU_SIZE, "frame exceeds the ADU buffer");
+
+    switch(msg->adu[1]) {
+
+        case ModBus_ReadHoldingRegisters:
+            FUZZ_CHECK(count >= 1 && count <= PICOHAL_READ_REGS_MAX, "bad read register count");
+            FUZZ_CHECK(msg->tx_length == 8 && msg->rx_length == 5 + count * 2, "bad read frame length");
+            break;
+
+        case ModBus_WriteRegister:
+            FUZZ_CHECK(msg->tx_length == 8 && msg->rx_length == 8, "bad write frame length");
+            break;
+
+        case ModBus_WriteRegisters:
+            FUZZ_CHECK(count >= 1 && count <= PICOHAL_WRITE_REGS_MAX, "bad write register count");
+            FUZZ_CHECK((uint8_t)msg->adu[6] == count * 2, "bad write byte count");
+            FUZZ_CHECK(msg->tx_length == 9 + count * 2 && msg->rx_length == 8, "bad write multiple frame length");
+            break;
+
+        default:
+            FUZZ_CHECK(false, "unexpected function code");
+            break;
+    }
+}
+
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *cb, bool block)
+{
+    UNUSED(block);
+
+    FUZZ_CHECK(cb == &callbacks, "unexpected callbacks");
+    FUZZ_CHECK(picohal_is_front(msg->context), "sent message is not the queue front");
+    check_frame(msg);
+
+    on_wire = *msg;
+    frame_pending = true;
+
+    return true;
+}
+
+static void check_invariants (void)
+{
+    uint_fast8_t idx, pos;
+
+    FUZZ_CHECK(front < QUEUE_SIZE && item_count <= QUEUE_SIZE, "queue indices out of bounds");
+    FUZZ_CHECK(event_count <= PICOHAL_EVENT_QUEUE_SIZE && events_in_flight <= event_count, "event queue out of bounds");
+    FUZZ_CHECK(((uint64_t)output_bank_dirty >> PICOHAL_OUTPUT_REGS) == 0, "dirty bit beyond the output bank");
+
+    for(idx = 0; idx < item_count; idx++) {
+        pos = (front + idx) % QUEUE_SIZE;
+        FUZZ_CHECK(message_queue[pos].picohal_packet.context == &message_queue[pos].index, "context does not point to its slot");
+        FUZZ_CHECK(!message_queue[pos].latest_only || message_queue[pos].picohal_packet.adu[1] != ModBus_ReadHoldingRegisters, "read marked as state write");
+        check_frame(&message_queue[pos].picohal_packet);
+    }
+
+    for(idx = 0; idx < QUEUE_SIZE; idx++)
+        FUZZ_CHECK(picohal_is_front(&message_queue[idx].index) == (item_count && idx == front), "is_front disagrees with the ring");
+}
+
+static int_fast8_t find_queued (uint16_t index)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < queued_count; idx++) {
+        if(queued[idx].index == index)
+            return idx;
+    }
+
+    return -1;
+}
+
+// A frame updated in place goes out in the slot of the write it replaced, that is only in order
+// if every frame after it was queued later or updated in the same step.
+static void check_order (void)
+{
+    uint_fast8_t idx, pos, later;
+    int_fast8_t prev;
+
+    for(idx = 0; idx < queued_count; idx++)
+        queued[idx].updated = false;
+
+    for(idx = 0; idx < item_count; idx++) {
+        pos = (front + idx) % QUEUE_SIZE;
+        if((prev = find_queued(message_queue[pos].index)) >= 0)
+            queued[prev].updated = message_queue[pos].picohal_packet.tx_length != queued[prev].frame.tx_length ||
+                                    memcmp(message_queue[pos].picohal_packet.adu, queued[prev].frame.adu, queued[prev].frame.tx_length);
+    }
+
+    for(idx = 0; idx < item_count; idx++) {
+        pos = (front + idx) % QUEUE_SIZE;
+        if((prev = find_queued(message_queue[pos].index)) < 0 || !queued[prev].updated)
+            continue;
+        FUZZ_CHECK(prev > 0, "frame updated in place at the queue front");
+        for(later = idx + 1; later < item_count; later++) {
+            int_fast8_t next = find_queued(message_queue[(front + later) % QUEUE_SIZE].index);
+            //the high and low speed words are one write, the low word may keep its value.
+            if(later == idx + 1 && picohal_get_register(&message_queue[pos].picohal_packet.adu[2]) == PICOHAL_REG_SPINDLE_RPM32 &&
+                message_queue[pos].picohal_packet.adu[1] == ModBus_WriteRegister)
+                continue;
+            FUZZ_CHECK(next < 0 || queued[next].updated, "newer write moved ahead of a pending write");
+        }
+    }
+
+    for(idx = 0; idx < item_count; idx++) {
+        pos = (front + idx) % QUEUE_SIZE;
+        queued[idx].index = message_queue[pos].index;
+        queued[idx].frame = message_queue[pos].picohal_packet;
+    }
+    queued_count = item_count;
+}
+
+static void check_step (void)
+{
+    check_invariants();
+    check_order();
+}
+
+/* Board model */
+
+static bool board_has_register (uint16_t reg, bool write)
+{
+    switch(reg) {
+
+        case 0x0001:
+        case 0x0002:
+        case PICOHAL_REG_EVENT:
+        case 0x0100:
+        case 0x0110:
+        case 0x0120:
+        case 0x0121:
+        case 0x0200:
+        case 0x0201:
+            return write;
+
+        case PICOHAL_REG_HEARTBEAT:
+        case PICOHAL_REG_WATCHDOG:
+            return write && board.caps.watchdog;
+
+        case PICOHAL_REG_DEVICE_ID:
+        case PICOHAL_REG_FW_VERSION:
+        case PICOHAL_REG_CAPABILITIES:
+            return !write && !board.legacy;
+
+        case PICOHAL_REG_POWDER1_FLOW:
+        case PICOHAL_REG_POWDER1_FLOW + 1:
+            return write && board.caps.ext_flow;
+
+        case PICOHAL_REG_SPINDLE_RPM32:
+        case PICOHAL_REG_SPINDLE_RPM32 + 1:
+            return write && board.caps.ext_rpm;
+    }
+
+    if(reg >= PICOHAL_REG_STATE_BLOCK && reg < PICOHAL_REG_STATE_BLOCK + PICOHAL_STATE_BLOCK_SIZE)
+        return write && board.caps.state_block;
+
+    if(reg >= PICOHAL_REG_EVENT_FIFO && reg < PICOHAL_REG_EVENT_FIFO + PICOHAL_EVENT_BATCH)
+        return write && board.caps.event_fifo;
+
+    if(reg >= PICOHAL_REG_ANALOG_IN && reg < PICOHAL_REG_ANALOG_IN + PICOHAL_ANALOG_INPUTS)
+        return !write && board.caps.analog_in;
+
+    if(reg >= PICOHAL_REG_OUTPUT_BANK && reg < PICOHAL_REG_OUTPUT_BANK + PICOHAL_OUTPUT_REGS)
+        return board.caps.output_bank;
+
+    return false;
+}
+
+static uint16_t board_read (uint16_t reg)
+{
+    switch(reg) {
+
+        case PICOHAL_REG_DEVICE_ID:
+            return PICOHAL_DEVICE_ID;
+
+        case PICOHAL_REG_FW_VERSION:
+            return PICOHAL_FW_VERSION_MAJOR << 8;
+
+        case PICOHAL_REG_CAPABILITIES:
+            return board.caps.value;
+    }
+
+    if(reg >= PICOHAL_REG_ANALOG_IN && reg < PICOHAL_REG_ANALOG_IN + PICOHAL_ANALOG_INPUTS)
+        return board.analog[reg - PICOHAL_REG_ANALOG_IN];
+
+    return board.reg[reg];
+}
+
+static void board_log_event (uint16_t value, bool record)
+{
+    if(board.events < FUZZ_EVENTS_MAX) {
+        board.event[board.events] = value;
+        board.event_record[board.events++] = record;
+    }
+}
+
+static void board_write (uint16_t reg, uint16_t value)
+{
+    static const uint16_t state_block[PICOHAL_STATE_BLOCK_SIZE] = {
+        0x0001, 0x0002, 0x0100, 0x0110, 0x0120, PICOHAL_REG_POWDER1_FLOW, PICOHAL_REG_POWDER1_FLOW + 1
+    };
+
+    if(reg >= PICOHAL_REG_STATE_BLOCK && reg < PICOHAL_REG_STATE_BLOCK + PICOHAL_STATE_BLOCK_SIZE)
+        reg = state_block[reg - PICOHAL_REG_STATE_BLOCK];
+
+    //records of a batch are written to consecutive registers, the board logs them in order.
+    if(reg > PICOHAL_REG_EVENT_FIFO && reg < PICOHAL_REG_EVENT_FIFO + PICOHAL_EVENT_BATCH)
+        reg = PICOHAL_REG_EVENT_FIFO;
+
+    switch(reg) {
+
+        case PICOHAL_REG_EVENT:
+            board_log_event(value & 0xFF, false);
+            break;
+
+        case PICOHAL_REG_EVENT_FIFO:
+            board_log_event(value, true);
+            break;
+
+        case 0x0110:
+            if(value & 0x02)
+                board.mains_pulses++;
+            if(value & 0x10)
+                board.reset_pulses++;
+            value &= ~IPG_MOMENTARY;
+            break;
+
+        case 0x0121:
+            board.flow[0] = (value & 0xFF) << 8;
+            board.flow[1] = value & 0xFF00;
+            break;
+
+        case PICOHAL_REG_POWDER1_FLOW:
+        case PICOHAL_REG_POWDER1_FLOW + 1:
+            board.flow[reg - PICOHAL_REG_POWDER1_FLOW] = value;
+            break;
+
+        case 0x0201:
+            board.speed = value * 100UL;
+            break;
+
+        case PICOHAL_REG_SPINDLE_RPM32:
+            board.rpm_hi = value;
+            break;
+
+        case PICOHAL_REG_SPINDLE_RPM32 + 1:
+            board.speed = ((uint32_t)board.rpm_hi << 16) | value;   // latched on the low word
+            break;
+    }
+
+    board.reg[reg] = value;
+}
+
+// Answer the frame on the wire, as the board would.
+static void board_answer (void)
+{
+    modbus_message_t rsp = on_wire;
+    uint16_t reg = picohal_get_register(&on_wire.adu[2]);
+    uint_fast8_t idx, count = on_wire.adu[1] == ModBus_WriteRegister ? 1 : (uint8_t)on_wire.adu[5];
+    bool write = on_wire.adu[1] != ModBus_ReadHoldingRegisters;
+
+    frame_pending = false;
+
+    //frames reach the board in the order they were queued, never a later one first.
+    FUZZ_CHECK(picohal_is_front(on_wire.context), "answered frame is not the queue front");
+    FUZZ_CHECK(!board.answered || (int16_t)(*(uint16_t *)on_wire.context - board.last_index) >= 0, "frame reached the board out of order");
+    board.answered = true;
+    board.last_index = *(uint16_t *)on_wire.context;
+
+    for(idx = 0; idx < count; idx++) {
+        if(!board_has_register(reg + idx, write)) {
+            //legacy firmware rejects the device info read, anything else was never offered by the board.
+            FUZZ_CHECK(board.legacy && !write && reg >= PICOHAL_REG_DEVICE_ID && reg <= PICOHAL_REG_CAPABILITIES, "register not offered by the board");
+            callbacks.on_rx_exception(PICOHAL_EXCEPTION_ILLEGAL_ADDRESS, on_wire.context);
+            return;
+        }
+    }
+
+    if(write) {
+        for(idx = 0; idx < count; idx++)
+            board_write(reg + idx, on_wire.adu[1] == ModBus_WriteRegister
+                                    ? picohal_get_register(&on_wire.adu[4])
+                                    : picohal_get_register(&on_wire.adu[7 + idx * 2]));
+    } else {
+        //the device ID read starts a handshake, the board clears its output bank then.
+        if(reg == PICOHAL_REG_DEVICE_ID && board.caps.output_bank)
+            memset(&board.reg[PICOHAL_REG_OUTPUT_BANK], 0, PICOHAL_OUTPUT_REGS * sizeof(uint16_t));
+        rsp.adu[2] = count * 2;
+        for(idx = 0; idx < count; idx++) {
+            uint16_t value = board_read(reg + idx);
+            rsp.adu[3 + idx * 2] = value >> 8;
+            rsp.adu[4 + idx * 2] = value & 0xFF;
+        }
+    }
+
+    callbacks.on_rx_packet(&rsp);
+}
+
+/* Reference model */
+
+static uint16_t model_state_code (sys_state_t state)
+{
+    switch(state) {
+        case STATE_ALARM:
+        case STATE_ESTOP:
+            return 1;
+        case STATE_CYCLE:
+            return 2;
+        case STATE_HOLD:
+            return 3;
+        case STATE_TOOL_CHANGE:
+            return 4;
+        case STATE_IDLE:
+            return 5;
+        case STATE_HOMING:
+            return 6;
+        case STATE_JOG:
+            return 7;
+        default:
+            return 254;
+    }
+}
+
+static bool model_handles (user_mcode_t mcode)
+{
+    return mcode == 501 || mcode == 502 || mcode == 530 || (mcode >= 510 && mcode <= 517) || (mcode >= 520 && mcode <= 527);
+}
+
+static bool model_is_uint (float value)
+{
+    return value >= 0.0f && value == floorf(value);
+}
+
+// M501/M502 Q<10-150> and M530 P<channel> Q<bits> [L<1-16>] as documented, independent of validate().
+static status_code_t model_validate (const parser_block_t *block)
+{
+    uint32_t count;
+
+    switch(block->user_mcode) {
+
+        case 501:
+        case 502:
+            if(!block->words.q)
+                return Status_GcodeValueWordMissing;
+            if(isnan(block->values.q))
+                return Status_BadNumberFormat;
+            return block->values.q >= 10.0f && block->values.q <= 150.0f ? Status_OK : Status_GcodeValueOutOfRange;
+
+        case 530:
+            if(!picohal_caps.output_bank)
+                return Status_GcodeUnsupportedCommand;
+            if(!(block->words.p && block->words.q))
+                return Status_GcodeValueWordMissing;
+            if(isnan(block->values.p) || isnan(block->values.q))
+                return Status_BadNumberFormat;
+            count = block->words.l ? block->values.l : 1;
+            if(count < 1 || count > 16 || !model_is_uint(block->values.p) || block->values.p + count > PICOHAL_OUTPUT_CHANNELS ||
+                !model_is_uint(block->values.q) || block->values.q >= (float)(1UL << count))
+                return Status_GcodeValueOutOfRange;
+            return Status_OK;
+
+        default:
+            return model_handles(block->user_mcode) ? Status_OK : Status_Unhandled;
+    }
+}
+
+static void model_execute (const parser_block_t *block)
+{
+    uint32_t channel, last, bits;
+
+    switch(block->user_mcode) {
+        case 501:
+        case 502:
+            model.flow[block->user_mcode - 501] = (uint16_t)(block->values.q * PICOHAL_FLOW_SCALE + 0.5f);
+            break;
+        case 510: model.ipg.ready = 1; break;
+        case 511: model.ipg.ready = 0; break;
+        case 512: model.mains_pulses++; break;
+        case 513: model.reset_pulses++; break;
+        case 514: model.ipg.guide = 1; break;
+        case 515: model.ipg.guide = 0; break;
+        case 516: model.ipg.shutter = 1; break;
+        case 517: model.ipg.shutter = 0; break;
+        case 520: model.blc.argon = 1; break;
+        case 521: model.blc.argon = 0; break;
+        case 522: model.blc.powder1 = 1; break;
+        case 523: model.blc.powder1 = 0; break;
+        case 524: model.blc.powder2 = 1; break;
+        case 525: model.blc.powder2 = 0; break;
+        case 526: model.blc.powder_switch = 1; break;
+        case 527: model.blc.powder_switch = 0; break;
+        case 530:
+            channel = (uint32_t)block->values.p;
+            last = channel + (block->words.l ? block->values.l : 1);
+            bits = (uint32_t)block->values.q;
+            for(; channel < last; channel++, bits >>= 1) {
+                if(bits & 1)
+                    model.bank[channel / 16] |= 1 << (channel % 16);
+                else
+                    model.bank[channel / 16] &= ~(1 << (channel % 16));
+            }
+            break;
+    }
+}
+
+static void model_event (uint8_t event)
+{
+    if(event_count < PICOHAL_EVENT_QUEUE_SIZE && model.events < FUZZ_EVENTS_MAX)
+        model.event[model.events++] = event;
+}
+
+/* Operations */
+
+static float fuzz_value (void)
+{
+    switch(fuzz_byte() & 0x07) {
+        case 0:
+            return NAN;
+        case 1:
+            return -(float)fuzz_byte();
+        case 2:
+            return (float)fuzz_byte() + 0.5f;
+        case 3:
+            return (float)((fuzz_byte() << 8) | fuzz_byte());
+        case 4:
+            return 65536.0f + fuzz_byte();
+        default:
+            return (float)fuzz_byte();
+    }
+}
+
+static void fuzz_mcode (void)
+{
+    static const user_mcode_t mcodes[] = {
+        501, 502, 510, 511, 512, 513, 514, 515, 516, 517,
+        520, 521, 522, 523, 524, 525, 526, 527, 530, 530, 530, 503, 599
+    };
+    parser_block_t block = {0}, issued;
+    status_code_t status;
+    uint8_t words = fuzz_byte();
+
+    block.user_mcode = mcodes[fuzz_byte() % (sizeof(mcodes) / sizeof(user_mcode_t))];
+    block.words.p = !!(words & 0x01);
+    block.words.q = !!(words & 0x02);
+    block.words.l = !!(words & 0x04);
+    block.values.p = block.words.p ? ((words & 0x08) ? fuzz_value() : (float)(fuzz_byte() % (PICOHAL_OUTPUT_CHANNELS + 4))) : NAN;
+    block.values.q = block.words.q ? ((words & 0x10) ? fuzz_value() : 10.0f + fuzz_byte() * 0.75f) : NAN;
+    block.values.l = block.words.l ? ((words & 0x20) ? (uint32_t)fuzz_byte() << (fuzz_byte() & 0x0F) : fuzz_byte() % 18) : 0;
+    issued = block;
+
+    FUZZ_CHECK(grbl.user_mcode.check(block.user_mcode) == (model_handles(block.user_mcode) ? UserMCode_Normal : UserMCode_Unsupported), "check() result");
+
+    status = grbl.user_mcode.validate(&block);
+    FUZZ_CHECK(status == model_validate(&issued), "validate() result");
+
+    if(status == Status_OK) {
+        FUZZ_CHECK(!((issued.user_mcode == 501 || issued.user_mcode == 502) && block.words.q), "Q word not claimed");
+        FUZZ_CHECK(!(issued.user_mcode == 530 && (block.words.p || block.words.q || block.words.l)), "M530 words not claimed");
+        grbl.user_mcode.execute(current_state, &block);
+        model_execute(&issued);
+    }
+}
+
+static void fuzz_core_event (void)
+{
+    axes_signals_t axes = {0};
+    uint8_t sel = fuzz_byte();
+
+    switch(sel % 6) {
+        case 0:
+            model_event(PROGRAM_COMPLETED);
+            grbl.on_program_completed(ProgramFlow_Running, false);
+            break;
+        case 1:
+            if(sel & 0x80)
+                model_event(HOMING_COMPLETED);
+            grbl.on_homing_completed(axes, !!(sel & 0x80));
+            break;
+        case 2:
+            model_event(PROBE_START);
+            grbl.on_probe_start(axes, NULL, NULL);
+            break;
+        case 3:
+            model_event(PROBE_COMPLETED);
+            grbl.on_probe_completed();
+            break;
+        case 4:
+            if(sel & 0x80)
+                model_event(PROBE_FIXTURE);
+            grbl.on_probe_fixture(NULL, false, !!(sel & 0x80));
+            break;
+        default:
+            model_event(TOOLCHANGE_ACK);
+            grbl.on_toolchange_ack();
+            break;
+    }
+}
+
+static void fuzz_state_change (void)
+{
+    static const sys_state_t states[] = {
+        STATE_IDLE, STATE_ALARM, STATE_CYCLE, STATE_HOLD, STATE_JOG, STATE_HOMING,
+        STATE_TOOL_CHANGE, STATE_ESTOP, STATE_SAFETY_DOOR, STATE_CHECK_MODE
+    };
+
+    sys.alarm = fuzz_byte() & 0x0F;
+    model.state = states[fuzz_byte() % (sizeof(states) / sizeof(sys_state_t))];
+    grbl.on_state_change(model.state);
+}
+
+static void fuzz_spindle (void)
+{
+    spindle_state_t state = { .value = fuzz_byte() & 0x03 };
+    float rpm = (float)((fuzz_byte() << 8) | fuzz_byte()) * ((fuzz_byte() & 0x01) ? 1.0f : 0.37f), scaled;
+    bool ext = picohal_caps.ext_rpm, set_state = !!(fuzz_byte() & 0x01);
+
+    if(set_state) {
+        model.spindle_mode = (!state.on || rpm == 0.0f) ? 0 : (state.ccw ? 3 : 1);
+        spindle_ptrs->set_state(NULL, state, rpm);
+    } else
+        spindle_ptrs->update_rpm(NULL, rpm);
+
+    scaled = rpm * PICOHAL_RPM_SCALE;
+    model.speed = ext ? (uint32_t)(scaled + 0.5f) : (uint32_t)rpm * 100UL;
+    model.spindle_set = true;
+}
+
+static void fuzz_reset (void)
+{
+    model.ipg.value = 0;
+    model.blc.value = 0;
+    memset(model.bank, 0, sizeof(model.bank));
+    hal.driver_reset();
+}
+
+// Stale responses and exceptions carry the context of a slot that is not the front.
+static void fuzz_stale (void)
+{
+    uint8_t sel = fuzz_byte();
+    uint_fast8_t front_before = front, items_before = item_count;
+    modbus_message_t rsp = on_wire;
+
+    rsp.context = &message_queue[(front + 1 + sel % (QUEUE_SIZE - 1)) % QUEUE_SIZE].index;
+
+    if(sel & 0x80)
+        callbacks.on_rx_exception(3 + fuzz_byte() % 9, rsp.context);
+    else
+        callbacks.on_rx_packet(&rsp);
+
+    FUZZ_CHECK(front == front_before && item_count == items_before, "stale response changed the queue");
+}
+
+// Answer frames until at most depth are pending, so that the next operation can not overflow the queue.
+static void fuzz_make_room (uint_fast8_t depth)
+{
+    uint_fast16_t polls;
+
+    if(picohal_link != PicoHAL_Ready)
+        depth = min(depth, 2);
+
+    for(polls = 0; polls < FUZZ_DRAIN_POLLS && item_count > depth; polls++) {
+        if(frame_pending)
+            board_answer();
+        else {
+            now_ms += POLLING_INTERVAL;
+            grbl.on_execute_realtime(STATE_IDLE);
+        }
+        check_step();
+    }
+
+    FUZZ_CHECK(item_count <= depth, "queue never made room");
+}
+
+static void fuzz_poll (void)
+{
+    now_ms += fuzz_byte();
+
+    if(fuzz_byte() & 0x01)
+        grbl.on_execute_realtime(STATE_IDLE);
+    else
+        grbl.on_execute_delay(STATE_IDLE);
+}
+
+/* Runs */
+
+static void fuzz_setup (void)
+{
+    uint8_t caps = fuzz_byte(), idx;
+
+    //plugin state, the queue storage itself is left as is to catch use of stale slots.
+    spindle_hal = NULL;
+    spindle_state.value = 0;
+    current_coolant_state.value = 0;
+    current_IPG_state.value = 0;
+    current_BLC_state.value = 0;
+    current_BLC_flowrate[0] = current_BLC_flowrate[1] = 10 << 8;
+    memset(current_output_bank, 0, sizeof(current_output_bank));
+    output_bank_dirty = 0;
+    picohal_caps.value = 0;
+    picohal_device_id = picohal_fw_version = 0;
+    picohal_link = PicoHAL_Offline;
+    heartbeat_seq = 0;
+    event_head = event_count = events_in_flight = event_seq = 0;
+    analog_next = 0;
+    analog_read_pending = analog_valid = analog_registered = false;
+    memset(&exceptions, 0, sizeof(exceptions));
+    current_state = STATE_IDLE;
+    coolant_pending = state_pending = false;
+    front = (uint_fast8_t)(fuzz_byte() % QUEUE_SIZE);
+    item_count = 0;
+
+    memset(&grbl, 0, sizeof(grbl));
+    memset(&hal, 0, sizeof(hal));
+    memset(&sys, 0, sizeof(sys));
+    hal.get_elapsed_ticks = get_elapsed_ticks;
+    hal.driver_reset = core_noop;
+    hal.stream.write = core_write;
+    grbl.on_report_options = core_report_options;
+    grbl.on_execute_realtime = grbl.on_execute_delay = core_execute_realtime;
+
+    memset(&board, 0, sizeof(board));
+    board.legacy = (caps & 0x80) != 0;
+    board.caps.value = board.legacy ? 0 : (caps & 0x7F);
+    for(idx = 0; idx < PICOHAL_ANALOG_INPUTS; idx++)
+        board.analog[idx] = (fuzz_byte() << 8) | idx;
+
+    memset(&model, 0, sizeof(model));
+    model.flow[0] = model.flow[1] = 10 << 8;
+    model.state = STATE_IDLE;
+
+    frame_pending = false;
+    queued_count = 0;
+    spindle_ptrs = NULL;
+    analog_ports_added = NULL;
+
+    picohal_init();
+    hal.driver_reset();
+
+    FUZZ_CHECK(spindle_ptrs != NULL, "spindle not registered");
+}
+
+static bool fuzz_drain (void)
+{
+    uint_fast16_t polls;
+
+    for(polls = 0; polls < FUZZ_DRAIN_POLLS; polls++) {
+        if(!frame_pending && item_count == 0 && output_bank_dirty == 0 && event_count == 0 &&
+            !coolant_pending && !state_pending && picohal_link == PicoHAL_Ready)
+            return true;
+        now_ms += POLLING_INTERVAL;
+        grbl.on_execute_realtime(STATE_IDLE);
+        if(frame_pending)
+            board_answer();
+        check_step();
+    }
+
+    return false;
+}
+
+static void fuzz_compare (void)
+{
+    uint_fast16_t idx;
+    uint8_t seq = 0;
+
+    FUZZ_CHECK(picohal_caps.value == board.caps.value, "capabilities not negotiated");
+    FUZZ_CHECK(board.reg[0x0001] == model_state_code(model.state), "status lost");
+    FUZZ_CHECK(board.reg[0x0100] == model.coolant.value, "coolant state lost");
+    FUZZ_CHECK(board.reg[0x0110] == (model.ipg.value & ~IPG_MOMENTARY), "IPG state lost");
+    FUZZ_CHECK(board.reg[0x0120] == model.blc.value, "BLC state lost");
+    FUZZ_CHECK(board.mains_pulses == model.mains_pulses && board.reset_pulses == model.reset_pulses, "IPG pulse lost or repeated");
+
+    for(idx = 0; idx < 2; idx++) {
+        if(board.caps.ext_flow)
+            FUZZ_CHECK(board.flow[idx] == model.flow[idx], "flow rate lost");
+        else
+            FUZZ_CHECK((board.flow[idx] >> 8) == (model.flow[idx] >> 8), "legacy flow rate lost");
+    }
+
+    if(board.caps.output_bank) {
+        for(idx = 0; idx < PICOHAL_OUTPUT_REGS; idx++)
+            FUZZ_CHECK(board.reg[PICOHAL_REG_OUTPUT_BANK + idx] == model.bank[idx], "output bank state lost");
+    }
+
+    if(model.spindle_set) {
+        FUZZ_CHECK(board.reg[0x0200] == model.spindle_mode, "spindle state lost");
+        FUZZ_CHECK(board.speed == model.speed, "spindle speed lost");
+    }
+
+    FUZZ_CHECK(board.events == model.events, "event lost or repeated");
+    for(idx = 0; idx < board.events; idx++) {
+        FUZZ_CHECK((board.event[idx] & 0xFF) == model.event[idx], "events out of order");
+        if(board.event_record[idx]) {
+            FUZZ_CHECK(idx == 0 || !board.event_record[idx - 1] || (board.event[idx] >> 8) == seq, "event record sequence gap");
+            seq = (board.event[idx] >> 8) + 1;
+        }
+    }
+
+    FUZZ_CHECK((analog_ports_added != NULL) == board.caps.analog_in, "analog ports registered without firmware support");
+    if(analog_ports_added) {
+        bool fresh = analog_valid && now_ms - analog_ms < PICOHAL_ANALOG_MAX_AGE;
+        for(idx = 0; idx < PICOHAL_ANALOG_INPUTS; idx++)
+            FUZZ_CHECK(analog_ports_added->wait_on_input(Port_Analog, idx, WaitMode_Immediate, 0.0f) == (fresh ? board.analog[idx] : -1), "analog input value");
+    }
+}
+
+int picohal_fuzz_run (const uint8_t *data, size_t size)
+{
+    uint8_t op;
+
+    input = data;
+    input_left = size;
+
+    fuzz_setup();
+
+    while(input_left) {
+
+        op = fuzz_byte();
+
+        switch(op & 0x0F) {
+
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+                if(frame_pending)
+                    board_answer();
+                break;
+
+            case 4:     // not 1 or 2, those are the legacy firmware answer to the handshake
+                if(frame_pending) {
+                    frame_pending = false;
+                    callbacks.on_rx_exception(3 + fuzz_byte() % 9, on_wire.context);
+                }
+                break;
+
+            case 5:
+                fuzz_stale();
+                break;
+
+            case 6:
+            case 7:
+                fuzz_poll();
+                break;
+
+            case 8:
+            case 9:
+            case 10:
+                fuzz_make_room(FUZZ_QUEUE_DEPTH);
+                fuzz_mcode();
+                break;
+
+            case 11:
+                fuzz_make_room(FUZZ_QUEUE_DEPTH);
+                model.coolant.value = fuzz_byte() & 0x03;
+                hal.coolant.set_state(model.coolant);
+                break;
+
+            case 12:
+                fuzz_make_room(FUZZ_QUEUE_DEPTH);
+                fuzz_state_change();
+                break;
+
+            case 13:
+                fuzz_core_event();
+                break;
+
+            case 14:
+                fuzz_make_room(FUZZ_QUEUE_DEPTH);
+                fuzz_spindle();
+                break;
+
+            default:
+                if(op & 0xE0)
+                    fuzz_poll();
+                else {
+                    fuzz_make_room(FUZZ_QUEUE_DEPTH);
+                    fuzz_reset();
+                }
+                break;
+        }
+
+        check_step();
+    }
+
+    FUZZ_CHECK(fuzz_drain(), "queue never drained");
+
+    fuzz_compare();
+
+    return 0;
+}
+
+#ifdef PICOHAL_LIBFUZZER
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+    picohal_fuzz_run(data, size);
+
+    return 0;
+}
+
+#else
+
+// Usage: picohal_fuzz [runs [seed]], each run is a pseudo random input of up to 256 bytes.
+int main (int argc, char **argv)
+{
+    static uint8_t data[256];
+    uint32_t runs = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 0x5048;
+    uint32_t run;
+    size_t idx, size;
+
+    for(run = 0; run < runs; run++) {
+
+        seed ^= seed << 13;                             // xorshift32
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+
+        size = 1 + seed % sizeof(data);
+        for(idx = 0; idx < size; idx++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            data[idx] = (uint8_t)(seed >> 11);
+        }
+
+        picohal_fuzz_run(data, size);
+    }
+
+    printf("picohal_fuzz: %lu runs compared against the model (ADU %u)\n", (unsigned long)runs, (unsigned)MODBUS_MAX_ADU_SIZE);
+
+    return EXIT_SUCCESS;
+}
+
+#endif
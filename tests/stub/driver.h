@@ -0,0 +1,5 @@
+/*
+  driver.h - host stand-in for the driver, nothing used by picohal.c.
+*/
+
+#pragma once
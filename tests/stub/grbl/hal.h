@@ -0,0 +1,240 @@
+/*
+  hal.h - host stand-in for the grblHAL core, only what picohal.c uses.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#define On 1
+#define Off 0
+#define UNUSED(x) (void)(x)
+#define ASCII_EOL "\r\n"
+
+#define SPINDLE_ENABLE  0xFFFF
+#define SPINDLE_PICOHAL 5
+
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+
+typedef uint_fast16_t sys_state_t;
+
+enum {
+    STATE_IDLE = 0,
+    STATE_ALARM = 1 << 0,
+    STATE_CHECK_MODE = 1 << 1,
+    STATE_HOMING = 1 << 2,
+    STATE_CYCLE = 1 << 3,
+    STATE_HOLD = 1 << 4,
+    STATE_JOG = 1 << 5,
+    STATE_SAFETY_DOOR = 1 << 6,
+    STATE_SLEEP = 1 << 7,
+    STATE_ESTOP = 1 << 8,
+    STATE_TOOL_CHANGE = 1 << 9
+};
+
+typedef union {
+    uint8_t value;
+    uint8_t mask;
+    struct {
+        uint8_t flood  :1,
+                mist   :1,
+                unused :6;
+    };
+} coolant_state_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t on     :1,
+                ccw    :1,
+                unused :6;
+    };
+} spindle_state_t;
+
+typedef union {
+    uint8_t value;
+    uint8_t mask;
+    struct {
+        uint8_t x :1, y :1, z :1, a :1, b :1, c :1, u :1, v :1;
+    };
+} axes_signals_t;
+
+typedef int8_t spindle_id_t;
+
+typedef struct {
+    float rpm_programmed;
+} spindle_data_t;
+
+typedef struct spindle_ptrs spindle_ptrs_t;
+
+typedef bool (*spindle_config_ptr)(spindle_ptrs_t *spindle);
+typedef void (*spindle_set_state_ptr)(spindle_ptrs_t *spindle, spindle_state_t state, float rpm);
+typedef spindle_state_t (*spindle_get_state_ptr)(spindle_ptrs_t *spindle);
+typedef void (*spindle_update_rpm_ptr)(spindle_ptrs_t *spindle, float rpm);
+
+typedef enum {
+    SpindleType_Stepper = 1
+} spindle_type_t;
+
+typedef union {
+    uint16_t value;
+    struct {
+        uint16_t variable       :1,
+                 at_speed       :1,
+                 direction      :1,
+                 cmd_controlled :1,
+                 laser          :1;
+    };
+} spindle_cap_t;
+
+struct spindle_ptrs {
+    spindle_id_t id;
+    spindle_type_t type;
+    uint8_t ref_id;
+    spindle_cap_t cap;
+    spindle_config_ptr config;
+    spindle_set_state_ptr set_state;
+    spindle_get_state_ptr get_state;
+    spindle_update_rpm_ptr update_rpm;
+};
+
+spindle_id_t spindle_register (const spindle_ptrs_t *spindle, const char *name);
+
+typedef uint16_t user_mcode_t;
+
+typedef enum {
+    UserMCode_Unsupported = 0,
+    UserMCode_Normal,
+    UserMCode_NoValueWords
+} user_mcode_type_t;
+
+typedef enum {
+    Status_OK = 0,
+    Status_BadNumberFormat = 2,
+    Status_GcodeUnsupportedCommand = 20,
+    Status_GcodeValueWordMissing = 36,
+    Status_GcodeValueOutOfRange = 39,
+    Status_Unhandled = 255
+} status_code_t;
+
+typedef union {
+    uint32_t mask;
+    struct {
+        uint32_t e :1,
+                 l :1,
+                 p :1,
+                 q :1,
+                 s :1;
+    };
+} parameter_words_t;
+
+typedef struct {
+    float e, p, q, s;
+    uint32_t l;
+} gc_values_t;
+
+typedef struct {
+    user_mcode_t user_mcode;
+    bool user_mcode_sync;
+    parameter_words_t words;
+    gc_values_t values;
+} parser_block_t;
+
+typedef user_mcode_type_t (*user_mcode_check_ptr)(user_mcode_t mcode);
+typedef status_code_t (*user_mcode_validate_ptr)(parser_block_t *gc_block);
+typedef void (*user_mcode_execute_ptr)(sys_state_t state, parser_block_t *gc_block);
+
+typedef struct {
+    user_mcode_check_ptr check;
+    user_mcode_validate_ptr validate;
+    user_mcode_execute_ptr execute;
+} user_mcode_ptrs_t;
+
+typedef enum {
+    ProgramFlow_Running = 0
+} program_flow_t;
+
+typedef enum {
+    Message_Plain = 0,
+    Message_Info,
+    Message_Warning
+} message_type_t;
+
+typedef void (*stream_write_ptr)(const char *s);
+typedef uint32_t report_tracking_flags_t;
+typedef struct tool_data tool_data_t;
+typedef struct plan_line_data plan_line_data_t;
+
+typedef void (*on_state_change_ptr)(sys_state_t state);
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_spindle_selected_ptr)(spindle_ptrs_t *spindle);
+typedef void (*on_program_completed_ptr)(program_flow_t program_flow, bool check_mode);
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef void (*on_realtime_report_ptr)(stream_write_ptr stream_write, report_tracking_flags_t report);
+typedef void (*on_homing_completed_ptr)(axes_signals_t homing_cycle, bool success);
+typedef bool (*on_probe_start_ptr)(axes_signals_t axes, float *target, plan_line_data_t *pl_data);
+typedef void (*on_probe_completed_ptr)(void);
+typedef bool (*on_probe_fixture_ptr)(tool_data_t *tool, bool at_g59_3, bool on);
+typedef void (*on_toolchange_ack_ptr)(void);
+typedef void (*coolant_set_state_ptr)(coolant_state_t state);
+typedef void (*driver_reset_ptr)(void);
+
+typedef enum {
+    Port_Analog = 0,
+    Port_Digital = 1
+} io_port_type_t;
+
+typedef enum {
+    WaitMode_Immediate = 0,
+    WaitMode_Rise,
+    WaitMode_Fall,
+    WaitMode_High,
+    WaitMode_Low
+} wait_mode_t;
+
+typedef int32_t (*wait_on_input_ptr)(io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout);
+
+typedef struct {
+    on_state_change_ptr on_state_change;
+    on_report_options_ptr on_report_options;
+    on_spindle_selected_ptr on_spindle_selected;
+    on_program_completed_ptr on_program_completed;
+    on_execute_realtime_ptr on_execute_realtime;
+    on_execute_realtime_ptr on_execute_delay;
+    on_realtime_report_ptr on_realtime_report;
+    on_homing_completed_ptr on_homing_completed;
+    on_probe_start_ptr on_probe_start;
+    on_probe_completed_ptr on_probe_completed;
+    on_probe_fixture_ptr on_probe_fixture;
+    on_toolchange_ack_ptr on_toolchange_ack;
+    user_mcode_ptrs_t user_mcode;
+} grbl_t;
+
+typedef struct {
+    coolant_set_state_ptr set_state;
+} coolant_ptrs_t;
+
+typedef struct {
+    void (*write)(const char *s);
+} io_stream_t;
+
+typedef struct {
+    uint32_t (*get_elapsed_ticks)(void);
+    driver_reset_ptr driver_reset;
+    coolant_ptrs_t coolant;
+    io_stream_t stream;
+} hal_t;
+
+typedef struct {
+    uint8_t alarm;
+} system_t;
+
+extern grbl_t grbl;
+extern hal_t hal;
+extern system_t sys;
+
+char *uitoa (uint32_t n);
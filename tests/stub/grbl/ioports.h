@@ -0,0 +1,46 @@
+/*
+  ioports.h - host stand-in for the grblHAL core, only what picohal.c uses.
+*/
+
+#pragma once
+
+typedef enum {
+    Port_Input = 0,
+    Port_Output = 1
+} io_port_direction_t;
+
+typedef enum {
+    Input_Analog_Aux0 = 100
+} pin_function_t;
+
+typedef enum {
+    PinGroup_AuxInputAnalog = 20
+} pin_group_t;
+
+struct xbar;
+
+typedef float (*xbar_get_value_ptr)(struct xbar *pin);
+
+typedef struct xbar {
+    pin_function_t function;
+    pin_group_t group;
+    uint8_t pin;
+    void *port;
+    const char *description;
+    xbar_get_value_ptr get_value;
+} xbar_t;
+
+typedef xbar_t *(*get_pin_info_ptr)(io_port_type_t type, io_port_direction_t dir, uint8_t port);
+typedef bool (*claim_port_ptr)(io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description);
+typedef void (*set_pin_description_ptr)(io_port_type_t type, io_port_direction_t dir, uint8_t port, const char *description);
+
+typedef struct {
+    uint8_t n_in;
+    uint8_t n_out;
+    wait_on_input_ptr wait_on_input;
+    get_pin_info_ptr get_pin_info;
+    claim_port_ptr claim;
+    set_pin_description_ptr set_pin_description;
+} io_analog_t;
+
+bool ioports_add_analog (io_analog_t *ports);
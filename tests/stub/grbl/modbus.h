@@ -0,0 +1,34 @@
+/*
+  modbus.h - host stand-in for the grblHAL core, only what picohal.c uses.
+*/
+
+#pragma once
+
+#ifndef MODBUS_MAX_ADU_SIZE
+#define MODBUS_MAX_ADU_SIZE 10
+#endif
+
+typedef enum {
+    ModBus_ReadCoils = 1,
+    ModBus_ReadDiscreteInputs = 2,
+    ModBus_ReadHoldingRegisters = 3,
+    ModBus_ReadInputRegisters = 4,
+    ModBus_WriteCoil = 5,
+    ModBus_WriteRegister = 6,
+    ModBus_WriteRegisters = 16
+} modbus_function_t;
+
+typedef struct {
+    void *context;
+    bool crc_check;
+    uint8_t tx_length;
+    uint8_t rx_length;
+    char adu[MODBUS_MAX_ADU_SIZE];
+} modbus_message_t;
+
+typedef struct {
+    void (*on_rx_packet)(modbus_message_t *msg);
+    void (*on_rx_exception)(uint8_t code, void *context);
+} modbus_callbacks_t;
+
+bool modbus_send (modbus_message_t *msg, const modbus_callbacks_t *callbacks, bool block);
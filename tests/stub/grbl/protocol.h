@@ -0,0 +1,9 @@
+/*
+  protocol.h - host stand-in for the grblHAL core, only what picohal.c uses.
+*/
+
+#pragma once
+
+typedef void (*foreground_task_ptr)(void *data);
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data);
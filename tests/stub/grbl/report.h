@@ -0,0 +1,8 @@
+/*
+  report.h - host stand-in for the grblHAL core, only what picohal.c uses.
+*/
+
+#pragma once
+
+void report_message (const char *msg, message_type_t type);
+void report_warning (void *message);
@@ -0,0 +1,5 @@
+/*
+  state_machine.h - host stand-in for the grblHAL core, nothing used by picohal.c.
+*/
+
+#pragma once